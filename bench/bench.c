@@ -0,0 +1,536 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../include/defaults.h"
+#include "../include/gfs.h"
+#include "../include/utils.h"
+
+/*
+ * Standalone benchmark of the filesystem API; prints its results as JSON on
+ * stdout. Takes the same options as ghonsla, except that -n is the largest
+ * directory the entry benchmarks build and -m the number of MBs the bandwidth
+ * benchmarks move. Every filesystem is created in a scratch directory made
+ * under the current one, and removed afterwards.
+ */
+
+#define BENCH_ENTRIES 1000000 /* default -n */
+#define BENCH_DATA	  64	 /* default -m */
+#define SEQ_CHUNK	  (1 << 20)
+#define RAND_CHUNK	  4096
+#define RAND_OPS	  65536
+#define APPEND_CHUNK  64 /* a log record */
+#define TEXT_LINE	  128 /* room for one line of bench_text()'s log */
+#define COPIES		  16  /* files bench_copies() splits its MBs between */
+#define SMALL_FILES	  10000
+#define SMALL_CHUNK	  100 /* a config file */
+#define TREE_FANOUT	  8
+#define TREE_DEPTH	  4
+#define TREE_FILES	  4 /* files in each of the deepest directories */
+
+static _bool firstResult = true;
+static char scratch[] = "ghonsla-bench-XXXXXX";
+
+static double now(void) {
+	struct timespec t;
+	clock_gettime(CLOCK_MONOTONIC, &t);
+	return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+/**
+ * @brief prints one result; `param` names what the benchmark was run at
+ * (e.g "entries"), and `bytes` is 0 for benchmarks that aren't about
+ * bandwidth
+ */
+static void emit(const char *name, const char *param, size_t value,
+				 size_t ops, size_t bytes, double secs) {
+	printf("%s\n    {\"bench\": \"%s\", \"%s\": %zu, \"ops\": %zu, "
+		   "\"seconds\": %.6f, \"ops_per_sec\": %.1f",
+		   firstResult ? "" : ",", name, param, value, ops, secs,
+		   secs > 0 ? ops / secs : 0);
+	if (bytes > 0)
+		printf(", \"mb_per_sec\": %.1f",
+			   secs > 0 ? bytes / secs / (1 << 20) : 0);
+	printf("}");
+
+	firstResult = false;
+}
+
+/**
+ * @brief prints how many blocks the data a benchmark left behind takes up
+ */
+static void emit_space(const char *name, size_t blocks) {
+	printf("%s\n    {\"bench\": \"%s\", \"blocks_used\": %zu}",
+		   firstResult ? "" : ",", name, blocks);
+	firstResult = false;
+}
+
+/**
+ * @brief creates an empty filesystem with room for `entries` entries and
+ * `dataMB` MBs of file data, on top of `fss`'s other settings
+ */
+static ghonsla_fs *fresh(struct fs_settings fss, const struct rt_settings *rts,
+						 size_t entries, size_t dataMB) {
+	unlink(FS_NAME);
+
+	const size_t mdMB = (MAX_SIZE_DIR_ENTRY * (entries + 1) +
+						 fss.jnlBlocks * fss.blockSize) >>
+						20;
+
+	/* doubled, so the FAT and free map always fit alongside */
+	fss.entryCount = entries + 1;
+	fss.size	   = 2 * (dataMB + mdMB) + 1;
+	fss.fMaxBlocks = dataMB * (1 << 20) / fss.blockSize + 1;
+
+	ghonsla_fs *h = gfs_open(&fss, rts);
+	if (h == NULL)
+		fprintf(stderr, "bench: couldn't create a %zu MB filesystem\n",
+				fss.size);
+	return h;
+}
+
+/**
+ * @brief removes the scratch directory, and the filesystem in it, if any
+ */
+static void leave_scratch(void) {
+	unlink(FS_NAME);
+	if (chdir("..") == -1 || rmdir(scratch) == -1)
+		perror("rmdir() in leave_scratch()");
+}
+
+/**
+ * @brief gives up on the whole run if a call into the filesystem failed, so
+ * that e.g a full disk is never passed off as throughput
+ */
+static void check(_bool ok, const char *call) {
+	if (ok)
+		return;
+
+	fprintf(stderr, "bench: %s failed\n", call);
+	leave_scratch();
+	exit(1);
+}
+
+static void discard(ghonsla_fs *h) {
+	gfs_close(h);
+	unlink(FS_NAME);
+}
+
+static void name_of(char *buf, const char *prefix, size_t i) {
+	snprintf(buf, MAX_NAME_LEN, "%s%zu", prefix, i);
+}
+
+/**
+ * @brief create, lookup, rename and remove throughput in a directory of `n`
+ * entries
+ */
+static _bool bench_entries(const struct fs_settings *fss,
+						   const struct rt_settings *rts, size_t n) {
+	ghonsla_fs *h = fresh(*fss, rts, n, 1);
+	if (h == NULL)
+		return false;
+
+	char name[MAX_NAME_LEN];
+	size_t *idx = malloc(n * sizeof(*idx));
+	if (idx == NULL) {
+		perror("malloc() in bench_entries()");
+		discard(h);
+		return false;
+	}
+
+	double t = now();
+	for (size_t i = 0; i < n; i++) {
+		name_of(name, "e", i);
+		check(gfs_create(h, name, ROOT_IDX, false), "gfs_create()");
+	}
+	emit("create", "entries", n, n, 0, now() - t);
+
+	t = now();
+	for (size_t i = 0; i < n; i++) {
+		name_of(name, "e", i);
+		idx[i] = gfs_lookup(h, name, ROOT_IDX);
+	}
+	emit("lookup", "entries", n, n, 0, now() - t);
+
+	t = now();
+	for (size_t i = 0; i < n; i++) {
+		name_of(name, "r", i);
+		check(gfs_rename(h, name, idx[i]), "gfs_rename()");
+	}
+	emit("rename", "entries", n, n, 0, now() - t);
+
+	t = now();
+	for (size_t i = 0; i < n; i++)
+		check(gfs_remove(h, idx[i]), "gfs_remove()");
+	emit("remove", "entries", n, n, 0, now() - t);
+
+	free(idx);
+	discard(h);
+	return true;
+}
+
+/**
+ * @brief sequential (in large and in small reads) and random bandwidth over
+ * one file of `mb` MBs, and small appends to another
+ */
+static _bool bench_data(const struct fs_settings *fss,
+						const struct rt_settings *rts, size_t mb) {
+	ghonsla_fs *h = fresh(*fss, rts, 2, mb);
+	if (h == NULL)
+		return false;
+
+	const size_t len = mb * (1 << 20), ops = MIN(RAND_OPS, len / RAND_CHUNK);
+	char *buf		 = malloc(SEQ_CHUNK);
+	if (buf == NULL) {
+		perror("malloc() in bench_data()");
+		discard(h);
+		return false;
+	}
+
+	for (size_t j = 0; j < SEQ_CHUNK; j++)
+		buf[j] = j * 31 + j / 4096;
+
+	check(gfs_create(h, "data", ROOT_IDX, false), "gfs_create()");
+	size_t f = gfs_lookup(h, "data", ROOT_IDX);
+
+	double t = now();
+	for (size_t off = 0; off < len; off += SEQ_CHUNK)
+		check(gfs_write(h, f, buf, SEQ_CHUNK, off) == 0, "gfs_write()");
+	check(gfs_sync(h), "gfs_sync()");
+	emit("seq_write", "mb", mb, len / SEQ_CHUNK, len, now() - t);
+
+	t = now();
+	for (size_t off = 0; off < len; off += SEQ_CHUNK)
+		check(gfs_read(h, f, buf, SEQ_CHUNK, off) == 0, "gfs_read()");
+	emit("seq_read", "mb", mb, len / SEQ_CHUNK, len, now() - t);
+
+	t = now();
+	for (size_t off = 0; off < len; off += RAND_CHUNK)
+		check(gfs_read(h, f, buf, RAND_CHUNK, off) == 0, "gfs_read()");
+	emit("stream_read", "mb", mb, len / RAND_CHUNK, len, now() - t);
+
+	srand(1);
+	t = now();
+	for (size_t j = 0; j < ops; j++)
+		check(gfs_read(h, f, buf, RAND_CHUNK, rand() % (len - RAND_CHUNK)) == 0,
+			  "gfs_read()");
+	emit("rand_read", "mb", mb, ops, ops * RAND_CHUNK, now() - t);
+
+	t = now();
+	for (size_t j = 0; j < ops; j++)
+		check(gfs_write(h, f, buf, RAND_CHUNK, rand() % (len - RAND_CHUNK)) == 0,
+			  "gfs_write()");
+	check(gfs_sync(h), "gfs_sync()");
+	emit("rand_write", "mb", mb, ops, ops * RAND_CHUNK, now() - t);
+
+	check(gfs_create(h, "log", ROOT_IDX, false), "gfs_create()");
+	size_t g	= gfs_lookup(h, "log", ROOT_IDX);
+	size_t nApp = MIN(RAND_OPS, len / APPEND_CHUNK);
+
+	t = now();
+	for (size_t j = 0; j < nApp; j++)
+		check(gfs_append(h, g, buf, APPEND_CHUNK) == 0, "gfs_append()");
+	check(gfs_sync(h), "gfs_sync()");
+	emit("append", "bytes", APPEND_CHUNK, nApp, nApp * APPEND_CHUNK,
+		 now() - t);
+
+	free(buf);
+	discard(h);
+	return true;
+}
+
+/**
+ * @brief writing, then reading back, a file of `mb` MBs of log lines, and the
+ * space it takes up; in large writes and reads, as compression works on
+ * whole clusters
+ */
+static _bool bench_text(const struct fs_settings *fss,
+						const struct rt_settings *rts, size_t mb) {
+	ghonsla_fs *h = fresh(*fss, rts, 2, mb);
+	if (h == NULL)
+		return false;
+
+	const size_t len = mb * (1 << 20);
+	char *buf		 = malloc(SEQ_CHUNK + TEXT_LINE);
+	if (buf == NULL) {
+		perror("malloc() in bench_text()");
+		discard(h);
+		return false;
+	}
+
+	srand(1);
+	for (size_t j = 0; j < SEQ_CHUNK;)
+		j += snprintf(buf + j, TEXT_LINE,
+					  "2024-05-%02d %02d:%02d:%02d INFO worker-%d: handled "
+					  "GET /api/items/%d in %d ms\n",
+					  rand() % 28 + 1, rand() % 24, rand() % 60, rand() % 60,
+					  rand() % 16, rand() % 100000, rand() % 500);
+
+	check(gfs_create(h, "log", ROOT_IDX, false), "gfs_create()");
+	size_t f			= gfs_lookup(h, "log", ROOT_IDX);
+	const size_t before = h->fss.freeBlocks;
+
+	double t = now();
+	for (size_t off = 0; off < len; off += SEQ_CHUNK)
+		check(gfs_write(h, f, buf, SEQ_CHUNK, off) == 0, "gfs_write()");
+	check(gfs_sync(h), "gfs_sync()");
+	emit("text_write", "mb", mb, len / SEQ_CHUNK, len, now() - t);
+
+	t = now();
+	for (size_t off = 0; off < len; off += SEQ_CHUNK)
+		check(gfs_read(h, f, buf, SEQ_CHUNK, off) == 0, "gfs_read()");
+	emit("text_read", "mb", mb, len / SEQ_CHUNK, len, now() - t);
+
+	emit_space("text_space", before - h->fss.freeBlocks);
+
+	free(buf);
+	discard(h);
+	return true;
+}
+
+/**
+ * @brief writing `mb` MBs as COPIES files with the same random content, then
+ * cloning one of them COPIES times, and the space either takes up; a
+ * filesystem that shares blocks only stores one, and clones without copying
+ */
+static _bool bench_copies(const struct fs_settings *fss,
+						  const struct rt_settings *rts, size_t mb) {
+	/* with room for the clones to be copies */
+	ghonsla_fs *h = fresh(*fss, rts, 2 * COPIES, 2 * mb);
+	if (h == NULL)
+		return false;
+
+	const size_t len = MAX(mb * (1 << 20) / COPIES, SEQ_CHUNK);
+	char *buf		 = malloc(SEQ_CHUNK);
+	if (buf == NULL) {
+		perror("malloc() in bench_copies()");
+		discard(h);
+		return false;
+	}
+
+	srand(1);
+	for (size_t j = 0; j < SEQ_CHUNK; j++)
+		buf[j] = rand();
+
+	char name[MAX_NAME_LEN];
+	const size_t before = h->fss.freeBlocks;
+
+	double t = now();
+	for (size_t c = 0; c < COPIES; c++) {
+		name_of(name, "copy", c);
+		check(gfs_create(h, name, ROOT_IDX, false), "gfs_create()");
+		size_t f = gfs_lookup(h, name, ROOT_IDX);
+		for (size_t off = 0; off < len; off += SEQ_CHUNK)
+			check(gfs_write(h, f, buf, SEQ_CHUNK, off) == 0, "gfs_write()");
+	}
+	check(gfs_sync(h), "gfs_sync()");
+	emit("copies_write", "mb", mb, COPIES * len / SEQ_CHUNK, COPIES * len,
+		 now() - t);
+
+	emit_space("copies_space", before - h->fss.freeBlocks);
+
+	/* and as many again, cloned from the first */
+	name_of(name, "copy", 0);
+	const size_t src = gfs_lookup(h, name, ROOT_IDX);
+	const size_t mid = h->fss.freeBlocks;
+
+	t = now();
+	for (size_t c = 0; c < COPIES; c++) {
+		name_of(name, "clone", c);
+		check(gfs_clone(h, src, name, ROOT_IDX), "gfs_clone()");
+	}
+	check(gfs_sync(h), "gfs_sync()");
+	emit("copies_clone", "mb", mb, COPIES, COPIES * len, now() - t);
+
+	emit_space("clones_space", mid - h->fss.freeBlocks);
+
+	free(buf);
+	discard(h);
+	return true;
+}
+
+/**
+ * @brief writing, then reading back, SMALL_FILES files of SMALL_CHUNK bytes
+ * each
+ */
+static _bool bench_small(const struct fs_settings *fss,
+						 const struct rt_settings *rts) {
+	ghonsla_fs *h = fresh(*fss, rts, SMALL_FILES,
+						  1 + ((SMALL_FILES * fss->blockSize) >> 20));
+	if (h == NULL)
+		return false;
+
+	char name[MAX_NAME_LEN], buf[SMALL_CHUNK];
+	size_t *idx = malloc(SMALL_FILES * sizeof(*idx));
+	if (idx == NULL) {
+		perror("malloc() in bench_small()");
+		discard(h);
+		return false;
+	}
+
+	memset(buf, 'c', SMALL_CHUNK);
+
+	double t = now();
+	for (size_t i = 0; i < SMALL_FILES; i++) {
+		name_of(name, "s", i);
+		check(gfs_create(h, name, ROOT_IDX, false), "gfs_create()");
+		idx[i] = gfs_lookup(h, name, ROOT_IDX);
+		check(gfs_write(h, idx[i], buf, SMALL_CHUNK, 0) == 0, "gfs_write()");
+	}
+	check(gfs_sync(h), "gfs_sync()");
+	emit("small_write", "files", SMALL_FILES, SMALL_FILES,
+		 SMALL_FILES * SMALL_CHUNK, now() - t);
+
+	t = now();
+	for (size_t i = 0; i < SMALL_FILES; i++)
+		check(gfs_read(h, idx[i], buf, SMALL_CHUNK, 0) == 0, "gfs_read()");
+	emit("small_read", "files", SMALL_FILES, SMALL_FILES,
+		 SMALL_FILES * SMALL_CHUNK, now() - t);
+
+	free(idx);
+	discard(h);
+	return true;
+}
+
+/**
+ * @brief time taken to write out all of the metadata of an image with room
+ * for `mb` MBs of data, and to mount it again
+ */
+static _bool bench_metadata(const struct fs_settings *fss,
+							const struct rt_settings *rts, size_t mb) {
+	ghonsla_fs *h = fresh(*fss, rts, NUM_ENTRIES, mb);
+	if (h == NULL)
+		return false;
+
+	char name[MAX_NAME_LEN];
+	for (size_t i = 0; i < NUM_ENTRIES; i++) {
+		name_of(name, "m", i);
+		check(gfs_create(h, name, ROOT_IDX, false), "gfs_create()");
+		const size_t f = gfs_lookup(h, name, ROOT_IDX);
+		check(gfs_append(h, f, name, strlen(name)) == 0, "gfs_append()");
+	}
+
+	struct fs_settings same = h->fss;
+
+	/* only the metadata is timed, not the appends held in memory */
+	check(gfs_sync(h), "gfs_sync()");
+	double t = now();
+	check(gfs_sync_all(h), "gfs_sync_all()");
+	emit("serialise", "image_mb", same.size, 1, 0, now() - t);
+
+	gfs_close(h);
+
+	t = now();
+	if ((h = gfs_open(&same, rts)) == NULL)
+		return false;
+	emit("deserialise", "image_mb", same.size, 1, 0, now() - t);
+
+	discard(h);
+	return true;
+}
+
+static size_t build_tree(ghonsla_fs *h, size_t dir, size_t depth) {
+	char name[MAX_NAME_LEN];
+	size_t made = 0;
+
+	if (depth == TREE_DEPTH) {
+		for (size_t i = 0; i < TREE_FILES; i++) {
+			name_of(name, "f", i);
+			check(gfs_create(h, name, dir, false), "gfs_create()");
+			const size_t f = gfs_lookup(h, name, dir);
+			check(gfs_append(h, f, name, strlen(name)) == 0, "gfs_append()");
+		}
+		return TREE_FILES;
+	}
+
+	for (size_t i = 0; i < TREE_FANOUT; i++) {
+		name_of(name, "d", i);
+		check(gfs_create(h, name, dir, true), "gfs_create()");
+		made += 1 + build_tree(h, gfs_lookup(h, name, dir), depth + 1);
+	}
+
+	return made;
+}
+
+/**
+ * @brief removing a directory tree TREE_DEPTH levels deep, with files at
+ * the bottom
+ */
+static _bool bench_tree(const struct fs_settings *fss,
+						const struct rt_settings *rts) {
+	size_t n = TREE_FILES, dirs = 1;
+	for (size_t d = 0; d < TREE_DEPTH; d++) {
+		n *= TREE_FANOUT;
+		dirs = dirs * TREE_FANOUT + 1;
+	}
+
+	ghonsla_fs *h =
+		fresh(*fss, rts, n + dirs, 1 + ((n * fss->blockSize) >> 20));
+	if (h == NULL)
+		return false;
+
+	check(gfs_create(h, "tree", ROOT_IDX, true), "gfs_create()");
+	size_t root = gfs_lookup(h, "tree", ROOT_IDX);
+	size_t made = 1 + build_tree(h, root, 0);
+
+	double t = now();
+	check(gfs_remove(h, root), "gfs_remove()");
+	emit("recursive_delete", "entries", made, made, 0, now() - t);
+
+	discard(h);
+	return true;
+}
+
+int main(int argc, char **argv) {
+	struct fs_settings fss;
+	struct rt_settings rts;
+
+	if (!parse_config_args(&fss, &rts, argc, argv))
+		return 1;
+
+	/* -m and -n mean something else here; see the top of the file */
+	size_t maxEntries = fss.entryCount == NUM_ENTRIES ? BENCH_ENTRIES
+													  : fss.entryCount;
+	size_t dataMB	  = fss.size == FS_SIZE ? BENCH_DATA : fss.size;
+
+	if (mkdtemp(scratch) == NULL || chdir(scratch) == -1) {
+		perror("mkdtemp() in main()");
+		return 1;
+	}
+
+	printf("{\n  \"config\": {\"block_size\": %zu, \"alloc\": \"%s\", "
+		   "\"journal_blocks\": %zu, \"group_commit\": %zu, "
+		   "\"cache_blocks\": %zu, \"io\": \"%s\", \"async\": \"%s\", "
+		   "\"compression\": \"%s\", \"sharing\": \"%s\"},\n"
+		   "  \"results\": [",
+		   fss.blockSize, fss.allocMode == ALLOC_EXTENT ? "extent" : "chain",
+		   fss.jnlBlocks, rts.groupCommit, rts.cacheBlocks,
+		   rts.ioMode == IO_MMAP ? "mmap" : "stdio",
+		   rts.aioMode == AIO_URING	  ? "uring"
+		   : rts.aioMode == AIO_THREADS ? "threads"
+										: "off",
+		   fss.compMode == COMP_LZ ? "lz" : "off",
+		   fss.shareMode == SHARE_DEDUP ? "dedup" : "off");
+
+	_bool ok = true;
+	for (size_t n = 1000; ok && n < maxEntries; n *= 10)
+		ok = bench_entries(&fss, &rts, n);
+	ok = ok && bench_entries(&fss, &rts, maxEntries);
+
+	ok = ok && bench_data(&fss, &rts, dataMB);
+	ok = ok && bench_text(&fss, &rts, dataMB);
+	ok = ok && bench_copies(&fss, &rts, dataMB);
+	ok = ok && bench_small(&fss, &rts);
+
+	for (size_t mb = 16; ok && mb <= 16 * dataMB; mb *= 4)
+		ok = bench_metadata(&fss, &rts, mb);
+
+	ok = ok && bench_tree(&fss, &rts);
+
+	printf("\n  ]\n}\n");
+
+	leave_scratch();
+	return ok ? 0 : 1;
+}
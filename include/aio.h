@@ -0,0 +1,64 @@
+#ifndef AIO_H
+#define AIO_H
+
+#include <pthread.h>
+#include <sys/uio.h>
+
+#include "filesystem.h"
+
+#define AIO_BATCH 32 /* requests one aio_batch holds in flight */
+#define AIO_IOV	  3	 /* buffers a read can be scattered over */
+
+typedef struct aio_req aio_req;
+typedef struct aio_batch aio_batch;
+
+struct aio_req {
+	_bool write;
+	size_t blockNo;			  /* first block */
+	size_t n;				  /* number of consecutive blocks */
+	size_t blockSize;
+	char *buf;				  /* n * blockSize bytes, unless iovcnt is set */
+	struct iovec iov[AIO_IOV]; /* for reads, buffers taking a whole number
+								  of blocks each; made from `buf` if
+								  iovcnt is 0 */
+	int iovcnt;
+	int res;				  /* 0 once done, negative on failure */
+	void (*done)(aio_req *r); /* called on completion from one of the
+								 engine's threads; may be NULL */
+	void *arg;				  /* for `done` */
+
+	/* owned by the engine */
+	aio_batch *batch;
+	aio_req *next;
+	size_t xfer;				/* bytes transferred so far */
+	struct iovec rest[AIO_IOV]; /* what's left of `iov` past those */
+};
+
+/* Requests that are waited on together, e.g every run of one read */
+struct aio_batch {
+	aio_req reqs[AIO_BATCH];
+	size_t blockSize;
+	size_t used;	/* requests handed out since the last wait */
+	size_t pending; /* requests still in flight */
+	int res;		/* first failure, if any */
+	pthread_mutex_t lock;
+	pthread_cond_t idle;
+};
+
+_bool aio_init(enum aio_mode mode, size_t depth);
+void aio_destroy(void);
+enum aio_mode aio_backend(void);
+
+int aio_submit(aio_req *r);
+
+void aio_batch_init(aio_batch *b, size_t blockSize);
+void aio_batch_destroy(aio_batch *b);
+int aio_read(aio_batch *b, size_t blockNo, size_t n, char *buf);
+int aio_readv(aio_batch *b, size_t blockNo, size_t n, const struct iovec *iov,
+			  int iovcnt);
+int aio_write(aio_batch *b, size_t blockNo, size_t n, const char *buf);
+void aio_flush(aio_batch *b);
+_bool aio_poll(aio_batch *b);
+int aio_wait(aio_batch *b);
+
+#endif // AIO_H
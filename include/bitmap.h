@@ -0,0 +1,17 @@
+#ifndef BITMAP_H
+#define BITMAP_H
+
+#include "filesystem.h"
+
+size_t bitmap_words(size_t numBlocks);
+void init_free_map(size_t nmb, fs_table *fat, struct fs_settings *const fss);
+size_t alloc_run(size_t goal, size_t want, size_t *got,
+				 struct fs_settings *const fss, const fs_table *fat);
+size_t alloc_whole_run(size_t goal, size_t want, struct fs_settings *const fss,
+					   const fs_table *fat);
+void free_run(size_t start, size_t len, struct fs_settings *const fss,
+			  const fs_table *fat);
+void share_run(size_t start, size_t len, const fs_table *fat);
+_bool block_is_free(size_t b, const fs_table *fat);
+
+#endif // BITMAP_H
@@ -0,0 +1,29 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../include/bool.h"
+
+struct cache_stats {
+	size_t hits;	   /* lookups served from memory */
+	size_t misses;	   /* lookups that had to go to disk */
+	size_t writeBacks; /* dirty blocks written back to disk */
+	size_t capacity;   /* number of blocks the cache can hold */
+};
+
+_bool cache_init(size_t capacity, size_t blockSize);
+void cache_destroy(void);
+_bool cache_enabled(void);
+
+int cache_read(size_t blockNo, char *buf);
+int cache_write(size_t blockNo, const char *buf);
+_bool cache_peek(size_t blockNo, char *buf);
+void cache_refresh(size_t blockNo, const char *buf);
+void cache_discard(size_t blockNo);
+int cache_flush(void);
+
+struct cache_stats cache_get_stats(void);
+
+#endif // CACHE_H
@@ -0,0 +1,11 @@
+#ifndef DEDUP_H
+#define DEDUP_H
+
+#include "filesystem.h"
+
+int write_shared(size_t i, const char *buf, size_t size,
+				 struct fs_settings *fss, size_t fPos, const fs_table *dt,
+				 const fs_table *fat);
+void dedup_reset(void);
+
+#endif // DEDUP_H
@@ -6,36 +6,64 @@
 #define NUM_ENTRIES 128		  /* number of file entries in the dir table */
 #define BLOCK_SIZE	1024	  /* number of bytes given to one block */
 #define FILE_BLOCKS 128		  /* number of blocks given to a file */
+#define CACHE_SIZE	64		  /* number of blocks held in the block cache */
+#define JNL_SIZE	64		  /* number of blocks given to the journal */
+#define GROUP_SIZE	8		  /* operations per journal commit */
+#define AIO_DEPTH	64		  /* requests the async engine keeps in flight */
+#define AIO_WORKERS 4		  /* threads used when io_uring is unavailable */
+#define RA_MIN		4		  /* blocks read ahead once a scan is seen */
+#define RA_MAX		(1 << 20) /* most bytes one readahead window takes */
+#define CLONE_CHUNK (1 << 20) /* most bytes clone_file() copies at a time */
 
 #define MAX_NAME_LEN		  256 /* Maximum length of a file's name */
-#define MAX_SIZE_DIR_ENTRY	  /* Largest possible entry in the dir table; we      \
-								 might be over-estimating a little because of 4   \
-								 bytes' worth of padding in the struct but that's \
-								 fine */                                          \
-	(sizeof(dir_entry) - sizeof(char *) + MAX_NAME_LEN)
+#define MAX_SIZE_DIR_ENTRY	  /* Most one entry takes up on disk: its record, \
+								 and the longest name in the name heap */     \
+	(sizeof(dir_entry) + MAX_NAME_LEN + 1)
 
+/* named "/" once the name heap is set up */
 #define DIR_TABLE_ROOT_ENTRY                                                   \
 	(dir_entry){.valid		   = true,                                         \
 				.isDir		   = true,                                         \
-				.nameLen	   = 1,                                            \
-				.name		   = "/",                                          \
+				.nameLen	   = 0,                                            \
+				.nameOff	   = 0,                                            \
 				.size		   = 0,                                            \
 				.parentIdx	   = 0,                                            \
-				.firstBlockIdx = SIZE_MAX};
+				.firstBlockIdx = NIL_IDX,                                      \
+				.firstChild	   = NIL_IDX,                                      \
+				.nextSibling   = NIL_IDX,                                      \
+				.prevSibling   = NIL_IDX};
 
 #define DIR_TABLE_GARBAGE_ENTRY                                                \
 	(dir_entry){.valid		   = false,                                        \
 				.isDir		   = false,                                        \
 				.nameLen	   = 0,                                            \
-				.name		   = "",                                           \
+				.nameOff	   = 0,                                            \
 				.size		   = 0,                                            \
 				.parentIdx	   = 0,                                            \
-				.firstBlockIdx = SIZE_MAX};
+				.firstBlockIdx = NIL_IDX,                                      \
+				.firstChild	   = NIL_IDX,                                      \
+				.nextSibling   = NIL_IDX,                                      \
+				.prevSibling   = NIL_IDX};
 
 #define DEFAULT_CFG                                                            \
-	(struct fs_settings){.size		 = FS_SIZE,                                \
+	(struct fs_settings){.magic		 = FS_MAGIC,                               \
+						 .version	 = FS_VERSION,                             \
+						 .size		 = FS_SIZE,                                \
 						 .entryCount = NUM_ENTRIES,                            \
 						 .blockSize	 = BLOCK_SIZE,                             \
-						 .fMaxBlocks = FILE_BLOCKS};
+						 .fMaxBlocks = FILE_BLOCKS,                            \
+						 .allocMode	 = ALLOC_CHAIN,                            \
+						 .compMode	 = COMP_OFF,                               \
+						 .jnlBlocks	 = JNL_SIZE,                               \
+						 .fmtMode	 = FORMAT_SPARSE,                          \
+						 .shareMode	 = SHARE_OFF};
+
+#define DEFAULT_RT_CFG                                                         \
+	(struct rt_settings){.cacheBlocks = CACHE_SIZE,                            \
+						 .ioMode	  = IO_STDIO,                              \
+						 .aioMode	  = AIO_URING,                             \
+						 .groupCommit = GROUP_SIZE,                            \
+						 .punchHoles  = false,                             \
+						 .pageMd	  = 0};
 
 #endif // DEFAULTS_H
@@ -0,0 +1,13 @@
+#ifndef DIRINDEX_H
+#define DIRINDEX_H
+
+#include "filesystem.h"
+
+_bool build_dir_index(fs_table *dt, _bool deferred);
+void free_dir_index(fs_table *dt);
+size_t dir_index_find(const char *name, unsigned short nameLen, size_t parent,
+					  const fs_table *dt);
+void dir_index_insert(size_t i, const fs_table *dt);
+void dir_index_remove(size_t i, const fs_table *dt);
+
+#endif // DIRINDEX_H
@@ -0,0 +1,19 @@
+#ifndef EXTENT_H
+#define EXTENT_H
+
+#include "filesystem.h"
+
+void init_extent_table(fs_table *runs, struct fs_settings *const fss);
+_bool append_run(uint32_t *firstExt, size_t start, size_t len,
+				 struct fs_settings *const fss, const fs_table *runs);
+size_t insert_run(uint32_t *firstExt, size_t after, size_t start, size_t len,
+				  struct fs_settings *const fss, const fs_table *runs);
+_bool has_spare_records(size_t n, const struct fs_settings *fss,
+						const fs_table *runs);
+void remap_runs(uint32_t *firstExt, const size_t *map, size_t from, size_t to,
+				uint32_t *runOf, struct fs_settings *const fss,
+				const fs_table *runs);
+void release_extent_list(size_t firstExt, struct fs_settings *const fss,
+						 const fs_table *runs);
+
+#endif // EXTENT_H
@@ -1,6 +1,7 @@
 #ifndef FILESYSTEM_H
 #define FILESYSTEM_H
 
+#include <pthread.h>
 #include <stdint.h>
 #include <stdlib.h>
 
@@ -8,6 +9,13 @@
 
 #define ROOT_IDX 0
 
+#define FS_MAGIC   0x616c736e6f6867 /* "ghonsla" */
+#define FS_VERSION 6				/* shared blocks */
+
+#define NIL_IDX UINT32_MAX /* ends a list of entries, blocks or extent runs */
+
+#define ZCLUSTER_BLOCKS 8 /* file blocks compressed as one; see zcluster.c */
+
 #define ERR_NO_AVAILABLE_BLOCKS                                                \
 	"write_to_file(): insufficient blocks available to complete write; "       \
 	"remove data and try again\n"
@@ -16,53 +24,181 @@
 	"write_to_file(): file has reached the maximum allowable number of "       \
 	"blocks (%zu)\n"
 
+enum alloc_mode {
+	ALLOC_CHAIN,  /* one FAT entry per block, blocks handed out one by one */
+	ALLOC_EXTENT, /* files are lists of (start, length) runs of blocks */
+};
+
+enum comp_mode {
+	COMP_OFF, /* file blocks are stored as they are */
+	COMP_LZ,  /* clusters of file blocks are compressed with lz.c */
+};
+
+enum share_mode {
+	SHARE_OFF,	 /* every block belongs to one file */
+	SHARE_DEDUP, /* blocks are reference counted, and whole blocks with the
+					same content are stored once; see dedup.c */
+};
+
+enum format_mode {
+	FORMAT_SPARSE,	 /* the image is extended with ftruncate(); blocks only
+						take up space once written */
+	FORMAT_PREALLOC, /* every block is reserved up front with fallocate() */
+};
+
 struct fs_settings {
+	/* Identify the image; checked on mount */
+
+	uint64_t magic;	  /* FS_MAGIC */
+	uint64_t version; /* on-disk format; FS_VERSION */
+
 	/* Configurable; determined via CLI args */
 
-	size_t size;	   /* filesystem size (in MBs) */
-	size_t entryCount; /* number of directory entries */
-	size_t blockSize;  /* size of one block */
-	size_t fMaxBlocks; /* max no. of blocks in one file */
+	size_t size;			   /* filesystem size (in MBs) */
+	size_t entryCount;		   /* number of directory entries */
+	size_t blockSize;		   /* size of one block */
+	size_t fMaxBlocks;		   /* max no. of blocks in one file */
+	enum alloc_mode allocMode; /* how files' blocks are laid out */
+	enum comp_mode compMode;   /* whether they're compressed; format version 5
+								  on, extent mode only */
+	size_t jnlBlocks;		   /* blocks given to the metadata journal */
+	enum format_mode fmtMode;  /* how the image's space is set aside */
+	enum share_mode shareMode; /* whether files may share blocks; format
+								  version 6 on, extent mode only */
 
 	/* Locked; determined at run-time based on the above */
 
-	size_t freeListPtr; /* first block of the 'free chain' */
+	size_t freeBlocks;	/* number of blocks set in the free map */
+	size_t freeExtPtr;	/* first spare extent record, NIL_IDX if none (extent
+						   mode only) */
 	size_t numBlocks;	/* number of blocks in the file */
-	size_t numMdBlocks; /* number of blocks used to hold metadata */
+	size_t numMdBlocks; /* number of blocks used to hold metadata, including
+						   the journal */
+	size_t jnlSeq;		/* journal generation; bumped by each checkpoint */
 };
 
+enum io_mode {
+	IO_STDIO, /* pread/pwrite on `fs`, optionally through the cache */
+	IO_MMAP,  /* `fs` is mapped once and blocks are memcpy'd in/out */
+};
+
+enum aio_mode {
+	AIO_OFF,	 /* multi-block requests are made one at a time */
+	AIO_URING,	 /* batches are queued through io_uring */
+	AIO_THREADS, /* batches are spread over a pool of threads */
+};
+
+/* Not persisted; re-read from the CLI on every launch */
+struct rt_settings {
+	size_t cacheBlocks; /* blocks held by the block cache; 0 disables it */
+	enum io_mode ioMode;
+	enum aio_mode aioMode; /* falls back to threads if io_uring is missing */
+	size_t groupCommit; /* operations batched into one journal commit */
+	_bool punchHoles;	/* give freed blocks' space back to the host fs */
+	size_t pageMd;		/* page metadata in on demand, holding at most this
+						   many MBs of changes; 0 reads it all at mount */
+};
+
+/* Stored as is in the directory table region; fixed-width, so the table is
+ * read and written in bulk. Links to other entries and to blocks are 32-bit,
+ * NIL_IDX if there are none. */
 typedef struct {
 	_bool valid;			/* entry holds a file or directory currently */
 	_bool isDir;			/* entry is a directory */
 	unsigned short nameLen; /* name's length */
-	char *name;				/* dir/file's name */
+	uint32_t nameOff;		/* where the name starts in the name heap */
 	size_t size;			/* number of bytes a file occupies */
-	size_t parentIdx;		/* the index of the dir this entry is in */
-	size_t firstBlockIdx;	/* the index of the first block holding this file's
+	uint32_t parentIdx;		/* the index of the dir this entry is in */
+	uint32_t firstBlockIdx; /* the index of the first block holding this file's
 							   content chain in the FAT */
+	uint32_t firstChild;	/* a directory's first child */
+	uint32_t nextSibling;	/* the next child of the same parent */
+	uint32_t prevSibling;	/* the previous child of the same parent; the
+							   first child's points at the last one */
 } dir_entry;
 
+/* How much of a block is in use follows from its file's size, so all the FAT
+ * holds is the chain */
 typedef struct {
-	size_t used; /* space used in this block */
-	size_t next; /* index of next block */
+	uint32_t next; /* index of next block */
 } fat_entry;
 
+typedef struct {
+	uint32_t start; /* first block of the run */
+	uint32_t len;	/* number of blocks in the run */
+	uint32_t next;	/* index of the next record in the same list */
+} extent;
+
+/* Stored as is in the block reference region, one per block, in filesystems
+ * that share blocks */
+typedef struct {
+	uint32_t refs; /* times extent records' runs take it in; 0 if free */
+	uint32_t hash; /* its content's, while it's in the dedup index; 0 if not */
+} block_ref;
+
+/* Not persisted; runtime state kept alongside each directory table entry */
+typedef struct {
+	size_t *blockMap;	  /* blockMap[k] is the k'th block of the file's chain,
+							 or the record of its k'th cluster if compressed;
+							 built lazily on first access */
+	size_t mapLen;		  /* number of entries in blockMap */
+	size_t mapCap;		  /* capacity of blockMap */
+	char *pend;			  /* bytes appended past the entry's `size` that
+							 are yet to be given blocks; a block's worth,
+							 or a cluster's if compressed, at most */
+	size_t pendLen;		  /* number of bytes in pend */
+	struct readahead *ra; /* blocks fetched ahead of a forward scan; see
+							 readahead.c */
+	uint32_t *runOf;	  /* where files share blocks, runOf[k] is the
+							 extent record holding blockMap[k], for as many
+							 entries as blockMap has room for; built lazily
+							 on first write, see remap_runs() */
+} file_state;
+
+/* Not persisted; open-addressing hash table over (parentIdx, name) */
+typedef struct {
+	size_t *slots;	  /* directory table indices, or one of the markers in
+						 dirindex.c */
+	size_t cap;		  /* number of slots; a power of two */
+	size_t live;	  /* slots holding an entry */
+	size_t tombs;	  /* slots left behind by removed entries */
+	size_t freeHint;  /* no free directory table entry lies below this */
+	_bool built;	  /* slots are filled in; see dirindex.c */
+	pthread_mutex_t fill;
+} dir_index;
+
+/* The directory table's names; kept exactly as the name heap region on disk,
+ * of which the first `len` bytes are in use */
+typedef struct {
+	char *buf;
+	size_t len;				  /* bytes handed out */
+	size_t cap;				  /* bytes allocated */
+	size_t max;				  /* size of the region on disk */
+	struct name_spans *spans; /* free space below `len`; see names.c */
+	_bool mapped;			  /* `buf` is the region itself, paged in */
+} name_heap;
+
 typedef struct {
 	size_t size;
 	union {
 		dir_entry *dirs;
-		fat_entry *blocks;
+		fat_entry *blocks; /* chain mode */
+		extent *runs;	   /* extent mode */
 	};
+	file_state *files; /* directory table only; one per entry */
+	dir_index *index;  /* directory table only; NULL if it couldn't be built */
+	name_heap *names;  /* directory table only */
+	uint64_t *freeMap; /* FAT only; one bit per block, set while it's free */
+	block_ref *refs;   /* FAT only; one per block, NULL unless blocks are
+						  shared */
+	_bool mapped;	   /* the arrays point into the metadata mapping */
 } fs_table;
 
 /* persistence */
 _bool deserialise_metadata(struct fs_settings *const fss, fs_table *const dt,
 						   fs_table *const fat);
-_bool serialise_metadata(const struct fs_settings *fss,
+_bool serialise_metadata(struct fs_settings *fss,
 						 const fs_table *const dt, const fs_table *const fat);
-_bool obtain_dir_entry_from_buf(dir_entry *const e, const char *const b,
-								size_t *const i);
-void write_dir_entry_to_buf(const dir_entry *const e, char *const b, size_t *i);
 
 /* partition management */
 _bool init_new_fat(size_t nb, size_t nmb, fs_table *fat,
@@ -71,15 +207,23 @@ _bool init_new_dir_t(int entryCount, fs_table *dt);
 _bool init_new_fs(struct fs_settings *const fss, fs_table *dt, fs_table *fat);
 void clear_out_fat(size_t nmb, fs_table *fat, struct fs_settings *const fss);
 void format_fs(struct fs_settings *fss, fs_table *dt, fs_table *fat);
+void free_tables(fs_table *dt, fs_table *fat);
 
 /* directory-table generic */
 size_t get_index_of_dir_entry(const char *name, size_t cwd, const fs_table *dt);
-_bool create_dir_entry(char *name, size_t cwd, _bool isDir, const fs_table *dt);
+_bool create_dir_entry(const char *name, size_t cwd, _bool isDir,
+					   const fs_table *dt);
 _bool remove_dir_entry(size_t i, fs_table *dt, fs_table *fat,
 					   struct fs_settings *const fss);
-_bool rename_dir_entry(char *newName, size_t i, fs_table *dt);
+_bool rename_dir_entry(const char *newName, size_t i, fs_table *dt,
+					   fs_table *fat, struct fs_settings *const fss);
 
 /* file-specific */
+size_t *get_block_map(size_t i, struct fs_settings *fss, const fs_table *dt,
+					  const fs_table *fat);
+uint32_t *get_run_index(size_t i, const fs_table *dt, const fs_table *fat);
+_bool reserve_block_map(size_t i, size_t n, const fs_table *dt);
+void drop_block_map(size_t i, const fs_table *dt);
 _bool truncate_file(size_t i, fs_table *dt, fs_table *fat,
 					struct fs_settings *const fss);
 int read_file_at(size_t i, char *const buf, size_t size,
@@ -91,6 +235,11 @@ int write_to_file(size_t i, const char *buf, size_t size,
 int append_to_file(size_t i, const char *buf, size_t size,
 				   struct fs_settings *fss, const fs_table *dt,
 				   const fs_table *fat);
+int flush_file(size_t i, struct fs_settings *fss, const fs_table *dt,
+			   const fs_table *fat);
+size_t file_size(size_t i, const fs_table *dt);
+_bool clone_file(size_t src, const char *name, size_t cwd,
+				 struct fs_settings *fss, fs_table *dt, fs_table *fat);
 
 /* directory-specific */
 dir_entry **get_directory_entries(size_t i, const fs_table *const dt,
@@ -98,7 +247,9 @@ dir_entry **get_directory_entries(size_t i, const fs_table *const dt,
 void print_directory_contents(size_t i, const fs_table *const dt);
 
 /* fs_settings */
-_bool parse_config_args(struct fs_settings *fss, int argc, char **argv);
+size_t fat_entry_size(const struct fs_settings *fss);
+_bool parse_config_args(struct fs_settings *fss, struct rt_settings *rts,
+						int argc, char **argv);
 _bool compute_and_check_block_counts(struct fs_settings *const fss);
 
 #endif // FILESYSTEM_H
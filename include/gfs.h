@@ -0,0 +1,40 @@
+#ifndef GFS_H
+#define GFS_H
+
+#include <pthread.h>
+
+#include "filesystem.h"
+
+/* An open filesystem. The block cache, the mapping and the journal are
+ * process-wide, so only one handle may be open at a time. */
+typedef struct {
+	struct fs_settings fss;
+	struct rt_settings rts;		/* as the handle was opened with */
+	fs_table dt;
+	fs_table fat;
+	int fd;						/* the image; also published as `fs` */
+	pthread_rwlock_t mdLock;	/* shared by lookups and reads; exclusive for
+								   anything that changes metadata */
+	pthread_mutex_t *fileLocks; /* one per directory table entry */
+} ghonsla_fs;
+
+ghonsla_fs *gfs_open(const struct fs_settings *fss,
+					 const struct rt_settings *rts);
+void gfs_close(ghonsla_fs *h);
+_bool gfs_sync(ghonsla_fs *h);
+_bool gfs_sync_all(ghonsla_fs *h);
+
+size_t gfs_lookup(ghonsla_fs *h, const char *name, size_t dir);
+_bool gfs_create(ghonsla_fs *h, const char *name, size_t dir, _bool isDir);
+_bool gfs_remove(ghonsla_fs *h, size_t i);
+_bool gfs_rename(ghonsla_fs *h, const char *name, size_t i);
+_bool gfs_truncate(ghonsla_fs *h, size_t i);
+_bool gfs_clone(ghonsla_fs *h, size_t i, const char *name, size_t dir);
+
+int gfs_read(ghonsla_fs *h, size_t i, char *buf, size_t size, size_t pos);
+int gfs_write(ghonsla_fs *h, size_t i, const char *buf, size_t size,
+			  size_t pos);
+int gfs_append(ghonsla_fs *h, size_t i, const char *buf, size_t size);
+int gfs_flush(ghonsla_fs *h, size_t i);
+
+#endif // GFS_H
@@ -0,0 +1,28 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include "filesystem.h"
+
+struct journal_stats {
+	size_t commits;		/* batches made durable */
+	size_t checkpoints; /* times the journal was folded into the metadata */
+};
+
+_bool journal_init(const struct fs_settings *fss);
+void journal_destroy(void);
+_bool journal_enabled(void);
+
+void journal_set_batch(size_t ops);
+size_t journal_batch(void);
+size_t journal_capacity(void);
+
+int journal_append(size_t off, const char *src, size_t len);
+int journal_commit(void);
+void journal_discard(void);
+void journal_reset(size_t seq);
+long journal_replay(char *md, size_t mdLen);
+int journal_fold(void);
+
+struct journal_stats journal_get_stats(void);
+
+#endif // JOURNAL_H
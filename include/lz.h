@@ -0,0 +1,12 @@
+#ifndef LZ_H
+#define LZ_H
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "../include/bool.h"
+
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap);
+_bool lz_decompress(const char *src, size_t n, char *dst, size_t out);
+
+#endif // LZ_H
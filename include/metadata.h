@@ -0,0 +1,34 @@
+#ifndef METADATA_H
+#define METADATA_H
+
+#include "filesystem.h"
+
+_bool md_init(struct fs_settings *fss, const fs_table *dt, const fs_table *fat,
+			  _bool allDirty);
+void md_destroy(void);
+size_t md_size(const struct fs_settings *fss);
+
+void md_set_paging(size_t cap);
+char *md_map(void);
+void md_unpack(const char *buf, const fs_table *dt, const fs_table *fat);
+
+size_t md_dir_offset(size_t i);
+size_t md_names_offset(void);
+size_t md_fat_offset(void);
+size_t md_map_offset(void);
+size_t md_refs_offset(void);
+
+void md_mark_all(void);
+void md_mark_dir(size_t i);
+void md_mark_name(size_t off, size_t len);
+void md_mark_fat(size_t i);
+void md_mark_map(size_t b);
+void md_mark_refs(size_t b, size_t n);
+
+void md_begin_op(void);
+void md_end_op(void);
+int md_commit(void);
+int md_checkpoint(struct fs_settings *fss, const fs_table *dt,
+				  const fs_table *fat);
+
+#endif // METADATA_H
@@ -0,0 +1,20 @@
+#ifndef NAMES_H
+#define NAMES_H
+
+#include "filesystem.h"
+
+size_t name_heap_size(size_t entryCount);
+_bool init_name_heap(fs_table *dt, char *src);
+void free_name_heap(fs_table *dt);
+const char *entry_name(const fs_table *dt, const dir_entry *e);
+void drop_name(size_t i, const fs_table *dt);
+_bool store_name(size_t i, const char *name, unsigned short nameLen,
+				 const fs_table *dt);
+_bool entry_is_inline(const dir_entry *e);
+char *inline_data(const fs_table *dt, const dir_entry *e);
+_bool store_inline(size_t i, const char *data, size_t len,
+				   const fs_table *dt);
+void settle_name_heap(const fs_table *dt);
+void drop_inline(size_t i, size_t len, const fs_table *dt);
+
+#endif // NAMES_H
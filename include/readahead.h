@@ -0,0 +1,12 @@
+#ifndef READAHEAD_H
+#define READAHEAD_H
+
+#include "filesystem.h"
+
+size_t readahead_serve(file_state *f, size_t fPos, size_t size,
+					   size_t blockSize, char *buf);
+void readahead_advance(file_state *f, size_t fPos, size_t size,
+					   size_t blockSize);
+void readahead_drop(file_state *f);
+
+#endif // READAHEAD_H
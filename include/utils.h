@@ -1,7 +1,11 @@
 #ifndef UTILS_H
 #define UTILS_H
 
+#include <stdint.h>
 #include <stdlib.h>
+#include <sys/uio.h>
+
+#include "../include/bool.h"
 
 #define RESET		 "\x1b[0m"
 #define RED			 "\x1b[31m"
@@ -35,7 +39,29 @@ char *copy_string(const char *str);
 char *double_if_Of(char *buf, size_t idx, size_t add, size_t *size);
 void parse_and_set_ul(unsigned long *dst, char *src);
 
+_bool size_fs(size_t len, _bool prealloc);
+void set_hole_punching(_bool enabled);
+void punch_blocks(size_t blockNo, size_t n, size_t blockSize);
+
+_bool map_fs(size_t len);
+void unmap_fs(void);
+char *block_ptr(size_t blockNo, size_t blockSize);
+int sync_fs(void);
+
 int read_block(size_t blockNo, size_t blockSize, char *buf);
 int write_block(size_t blockNo, size_t blockSize, const char *buf);
+int read_blocks(size_t blockNo, size_t n, size_t blockSize, char *buf);
+int read_blocksv(size_t blockNo, size_t n, size_t blockSize,
+				 const struct iovec *iov, int iovcnt);
+void peek_cached(size_t blockNo, size_t blockSize, const struct iovec *iov,
+				 int iovcnt);
+int write_blocks(size_t blockNo, size_t n, size_t blockSize, const char *buf);
+int dev_read_block(size_t blockNo, size_t blockSize, char *buf);
+int dev_read_blocks(size_t blockNo, size_t n, size_t blockSize, char *buf);
+int dev_read_blocksv(size_t blockNo, size_t blockSize, const struct iovec *iov,
+					 int iovcnt);
+int dev_write_block(size_t blockNo, size_t blockSize, const char *buf);
+int dev_write_blocks(size_t blockNo, size_t n, size_t blockSize,
+					 const char *buf);
 
 #endif // UTILS_H
@@ -0,0 +1,13 @@
+#ifndef ZCLUSTER_H
+#define ZCLUSTER_H
+
+#include "filesystem.h"
+
+int read_clusters(size_t i, char *const retBuf, size_t size,
+				  const struct fs_settings *fss, size_t fPos,
+				  const fs_table *dt, const fs_table *fat);
+int write_clusters(size_t i, const char *buf, size_t size,
+				   struct fs_settings *fss, size_t fPos, const fs_table *dt,
+				   const fs_table *fat);
+
+#endif // ZCLUSTER_H
@@ -0,0 +1,570 @@
+#define _GNU_SOURCE /* syscall() */
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#undef BLOCK_SIZE /* linux/fs.h's, pulled in by io_uring.h */
+
+#include "../include/aio.h"
+#include "../include/cache.h"
+#include "../include/defaults.h"
+#include "../include/utils.h"
+
+/*
+ * Requests are handed to io_uring, which is driven through raw syscalls, or
+ * when that is unavailable, to a pool of threads issuing pread()/pwrite().
+ * Either way, a request completes on one of the engine's threads: an
+ * io_uring reaper waiting on the completion queue, or the worker that served
+ * it. Like read_blocks() and write_blocks(), requests go around the block
+ * cache: reads pick up cached copies of their blocks on completion, and
+ * writes refresh them on submission.
+ */
+
+extern int fs;
+
+static struct {
+	enum aio_mode backend; /* AIO_OFF until set up */
+	size_t depth;		   /* requests allowed in flight */
+	size_t inflight;
+	size_t queued;		   /* SQEs the kernel hasn't been handed yet */
+	pthread_mutex_t lock;  /* guards submission and everything below */
+	pthread_cond_t room;   /* signalled as requests complete */
+
+	/* io_uring */
+	int ring;
+	char *sqMap, *cqMap;
+	size_t sqMapLen, cqMapLen;
+	struct io_uring_sqe *sqes;
+	size_t sqesLen;
+	unsigned *sqTail, *sqMask, *sqArray;
+	unsigned *cqHead, *cqTail, *cqMask;
+	struct io_uring_cqe *cqes;
+	pthread_t reaper;
+
+	/* thread pool */
+	pthread_t workers[AIO_WORKERS];
+	size_t nWorkers;
+	aio_req *qHead, *qTail;
+	pthread_cond_t work;
+	_bool stop;
+} a = {.backend = AIO_OFF,
+	   .lock	= PTHREAD_MUTEX_INITIALIZER,
+	   .room	= PTHREAD_COND_INITIALIZER,
+	   .work	= PTHREAD_COND_INITIALIZER};
+
+/**
+ * @brief hands a request's result to its owner; the request may be gone
+ * once this returns
+ */
+static void finish(aio_req *r, int res) {
+	aio_batch *b = r->batch;
+
+	r->res = res;
+	if (r->done != NULL)
+		r->done(r);
+
+	if (b != NULL) {
+		pthread_mutex_lock(&b->lock);
+		if (res != 0 && b->res == 0)
+			b->res = res;
+		if (--b->pending == 0)
+			pthread_cond_broadcast(&b->idle);
+		pthread_mutex_unlock(&b->lock);
+	}
+}
+
+static void complete(aio_req *r, int res) {
+	if (res == 0 && !r->write)
+		peek_cached(r->blockNo, r->blockSize, r->iov, r->iovcnt);
+
+	finish(r, res);
+
+	pthread_mutex_lock(&a.lock);
+	a.inflight--;
+	pthread_cond_signal(&a.room);
+	pthread_mutex_unlock(&a.lock);
+}
+
+static int uring_enter(unsigned submit, unsigned wait, unsigned flags) {
+	int ret;
+	do
+		ret = syscall(__NR_io_uring_enter, a.ring, submit, wait, flags, NULL,
+					  0);
+	while (ret == -1 && errno == EINTR);
+	return ret;
+}
+
+/**
+ * @brief queues one SQE for the rest of a request, from `xfer` bytes on; the
+ * caller holds `a.lock`. The kernel only sees it once uring_flush() is
+ * called. A NULL request asks the reaper to stop.
+ */
+static void uring_queue(aio_req *r) {
+	unsigned tail = *a.sqTail, idx = tail & *a.sqMask;
+	struct io_uring_sqe *sqe = &a.sqes[idx];
+
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->user_data = (uintptr_t)r;
+	if (r == NULL) {
+		sqe->opcode = IORING_OP_NOP;
+	} else {
+		int cnt		= 0;
+		size_t skip = r->xfer;
+		for (int v = 0; v < r->iovcnt; v++) {
+			if (skip >= r->iov[v].iov_len) {
+				skip -= r->iov[v].iov_len;
+				continue;
+			}
+			r->rest[cnt++] = (struct iovec){
+				.iov_base = (char *)r->iov[v].iov_base + skip,
+				.iov_len  = r->iov[v].iov_len - skip};
+			skip = 0;
+		}
+
+		sqe->opcode = r->write ? IORING_OP_WRITEV : IORING_OP_READV;
+		sqe->fd		= fs;
+		sqe->off	= r->blockNo * r->blockSize + r->xfer;
+		sqe->addr	= (uintptr_t)r->rest;
+		sqe->len	= cnt;
+	}
+
+	a.sqArray[idx] = idx;
+	__atomic_store_n(a.sqTail, tail + 1, __ATOMIC_RELEASE);
+	a.queued++;
+}
+
+/**
+ * @brief takes the SQEs the kernel hasn't consumed back off the ring; the
+ * caller holds `a.lock`
+ *
+ * @return their requests, linked through `next`
+ */
+static aio_req *uring_unqueue(void) {
+	aio_req *list = NULL;
+
+	for (; a.queued > 0; a.queued--) {
+		unsigned tail = *a.sqTail - 1;
+		__atomic_store_n(a.sqTail, tail, __ATOMIC_RELEASE);
+
+		struct io_uring_sqe *sqe = &a.sqes[a.sqArray[tail & *a.sqMask]];
+		aio_req *r				 = (aio_req *)(uintptr_t)sqe->user_data;
+		if (r != NULL) {
+			r->next = list;
+			list	= r;
+		}
+	}
+
+	return list;
+}
+
+/**
+ * @brief hands every SQE queued so far to the kernel with one
+ * io_uring_enter(), however many requests, and batches, they are of.
+ * Requests the kernel won't take are completed with an error.
+ *
+ * @return 0 on success, -1 if any request was turned away
+ */
+static int uring_flush(void) {
+	aio_req *failed = NULL;
+	int ret			= 0;
+
+	pthread_mutex_lock(&a.lock);
+	while (a.queued > 0) {
+		int n = uring_enter(a.queued, 0, 0);
+		if (n <= 0) {
+			if (n < 0)
+				perror("io_uring_enter() in uring_flush()");
+			failed = uring_unqueue();
+			ret	   = -1;
+			break;
+		}
+		a.queued -= n;
+	}
+	pthread_mutex_unlock(&a.lock);
+
+	for (aio_req *r = failed, *next; r != NULL; r = next) {
+		next = r->next;
+		complete(r, -1);
+	}
+
+	return ret;
+}
+
+static void *uring_reap(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		unsigned head = *a.cqHead;
+		if (head == __atomic_load_n(a.cqTail, __ATOMIC_ACQUIRE)) {
+			uring_enter(0, 1, IORING_ENTER_GETEVENTS);
+			continue;
+		}
+
+		struct io_uring_cqe *cqe = &a.cqes[head & *a.cqMask];
+		aio_req *r				 = (aio_req *)(uintptr_t)cqe->user_data;
+		int res					 = cqe->res;
+		__atomic_store_n(a.cqHead, head + 1, __ATOMIC_RELEASE);
+
+		if (r == NULL)
+			return NULL;
+
+		if (res < 0) {
+			fprintf(stderr, "io_uring request for block %zu: %s\n",
+					r->blockNo, strerror(-res));
+			complete(r, -3);
+		} else if (res > 0 && (r->xfer += res) < r->n * r->blockSize) {
+			/* a short transfer; carry on from where it stopped */
+			pthread_mutex_lock(&a.lock);
+			uring_queue(r);
+			pthread_mutex_unlock(&a.lock);
+			uring_flush();
+		} else {
+			/* one that makes no progress means EOF */
+			complete(r, res > 0 ? 0 : -2);
+		}
+	}
+}
+
+static void uring_unmap(void) {
+	if (a.sqes != NULL)
+		munmap(a.sqes, a.sqesLen);
+	if (a.cqMap != NULL && a.cqMap != a.sqMap)
+		munmap(a.cqMap, a.cqMapLen);
+	if (a.sqMap != NULL)
+		munmap(a.sqMap, a.sqMapLen);
+	a.sqes	= NULL;
+	a.sqMap = a.cqMap = NULL;
+}
+
+static void *ring_map(size_t len, off_t off) {
+	void *m = mmap(NULL, len, PROT_READ | PROT_WRITE,
+				   MAP_SHARED | MAP_POPULATE, a.ring, off);
+	return m == MAP_FAILED ? NULL : m;
+}
+
+/**
+ * @return false if io_uring is unavailable, e.g because the kernel predates
+ * it or a sandbox filters it out
+ */
+static _bool uring_init(void) {
+	struct io_uring_params p;
+	memset(&p, 0, sizeof(p));
+
+	if ((a.ring = syscall(__NR_io_uring_setup, a.depth, &p)) == -1)
+		return false;
+
+	a.sqMapLen = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+	a.cqMapLen = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+	a.sqesLen  = p.sq_entries * sizeof(struct io_uring_sqe);
+	if (p.features & IORING_FEAT_SINGLE_MMAP)
+		a.sqMapLen = a.cqMapLen = MAX(a.sqMapLen, a.cqMapLen);
+
+	a.sqMap = ring_map(a.sqMapLen, IORING_OFF_SQ_RING);
+	a.cqMap = (p.features & IORING_FEAT_SINGLE_MMAP)
+				  ? a.sqMap
+				  : ring_map(a.cqMapLen, IORING_OFF_CQ_RING);
+	a.sqes	= ring_map(a.sqesLen, IORING_OFF_SQES);
+
+	if (a.sqMap == NULL || a.cqMap == NULL || a.sqes == NULL) {
+		perror("mmap() in uring_init()");
+		goto fail;
+	}
+
+	a.sqTail  = (unsigned *)(a.sqMap + p.sq_off.tail);
+	a.sqMask  = (unsigned *)(a.sqMap + p.sq_off.ring_mask);
+	a.sqArray = (unsigned *)(a.sqMap + p.sq_off.array);
+	a.cqHead  = (unsigned *)(a.cqMap + p.cq_off.head);
+	a.cqTail  = (unsigned *)(a.cqMap + p.cq_off.tail);
+	a.cqMask  = (unsigned *)(a.cqMap + p.cq_off.ring_mask);
+	a.cqes	  = (struct io_uring_cqe *)(a.cqMap + p.cq_off.cqes);
+
+	/* the completion queue is twice as deep as the submission queue, so
+	 * capping what's in flight at the latter means it never overflows */
+	a.depth = MIN(a.depth, p.sq_entries);
+
+	if (pthread_create(&a.reaper, NULL, uring_reap, NULL) != 0) {
+		perror("pthread_create() in uring_init()");
+		goto fail;
+	}
+
+	return true;
+
+fail:
+	uring_unmap();
+	close(a.ring);
+	return false;
+}
+
+static void *worker(void *arg) {
+	(void)arg;
+
+	for (;;) {
+		pthread_mutex_lock(&a.lock);
+		while (!a.stop && a.qHead == NULL)
+			pthread_cond_wait(&a.work, &a.lock);
+
+		aio_req *r = a.qHead;
+		if (r == NULL) {
+			pthread_mutex_unlock(&a.lock);
+			return NULL;
+		}
+
+		if ((a.qHead = r->next) == NULL)
+			a.qTail = NULL;
+		pthread_mutex_unlock(&a.lock);
+
+		int res = r->write
+					  ? dev_write_blocks(r->blockNo, r->n, r->blockSize, r->buf)
+					  : dev_read_blocksv(r->blockNo, r->blockSize, r->iov,
+										 r->iovcnt);
+		complete(r, res);
+	}
+}
+
+static void stop_workers(void) {
+	pthread_mutex_lock(&a.lock);
+	a.stop = true;
+	pthread_cond_broadcast(&a.work);
+	pthread_mutex_unlock(&a.lock);
+
+	for (size_t t = 0; t < a.nWorkers; t++)
+		pthread_join(a.workers[t], NULL);
+	a.nWorkers = 0;
+}
+
+static _bool threads_init(void) {
+	a.stop	= false;
+	a.qHead = a.qTail = NULL;
+
+	for (a.nWorkers = 0; a.nWorkers < AIO_WORKERS; a.nWorkers++) {
+		if (pthread_create(&a.workers[a.nWorkers], NULL, worker, NULL) != 0) {
+			perror("pthread_create() in threads_init()");
+			stop_workers();
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/**
+ * @brief sets up the engine, keeping up to `depth` requests in flight. If
+ * io_uring is asked for but unavailable, a thread pool is used instead; if
+ * that fails too, the engine stays off and batches are served synchronously.
+ */
+_bool aio_init(enum aio_mode mode, size_t depth) {
+	aio_destroy();
+
+	a.depth		= MAX(depth, 1);
+	a.inflight	= 0;
+	a.queued	= 0;
+
+	if (mode == AIO_URING && uring_init())
+		a.backend = AIO_URING;
+	else if (mode != AIO_OFF && threads_init())
+		a.backend = AIO_THREADS;
+
+	return mode == AIO_OFF || a.backend != AIO_OFF;
+}
+
+/**
+ * @brief stops the engine; nothing may be in flight
+ */
+void aio_destroy(void) {
+	if (a.backend == AIO_URING) {
+		pthread_mutex_lock(&a.lock);
+		uring_queue(NULL);
+		pthread_mutex_unlock(&a.lock);
+		_bool stopped = uring_flush() == 0;
+
+		if (stopped)
+			pthread_join(a.reaper, NULL);
+		else
+			pthread_cancel(a.reaper);
+
+		uring_unmap();
+		close(a.ring);
+	} else if (a.backend == AIO_THREADS) {
+		stop_workers();
+	}
+
+	a.backend = AIO_OFF;
+}
+
+enum aio_mode aio_backend(void) { return a.backend; }
+
+/**
+ * @brief starts a request; it completes, successfully or not, on one of the
+ * engine's threads, which sets `res` and calls `done`. Blocks while the
+ * engine already has `depth` requests in flight. If the engine is off or the
+ * blocks are mapped, the request is served and completed right away.
+ * Requests of a batch are only queued on the io_uring until the batch is
+ * flushed, so it's submitted with a single syscall.
+ *
+ * @return 0 if the request was started, or queued; negative if it couldn't
+ * be, in which case it has still been completed with that error
+ */
+int aio_submit(aio_req *r) {
+	const size_t bs = r->blockSize;
+
+	r->res = 0;
+	if (r->iovcnt == 0) {
+		r->iov[0] = (struct iovec){.iov_base = r->buf, .iov_len = r->n * bs};
+		r->iovcnt = 1;
+	}
+
+	if (a.backend == AIO_OFF ||
+		block_ptr(r->blockNo + r->n - 1, bs) != NULL) {
+		int ret;
+		if (r->write)
+			ret = write_blocks(r->blockNo, r->n, bs, r->buf);
+		else if (r->iovcnt == 1) /* may serve a lone block from the cache */
+			ret = read_blocks(r->blockNo, r->n, bs, r->iov[0].iov_base);
+		else
+			ret = read_blocksv(r->blockNo, r->n, bs, r->iov, r->iovcnt);
+
+		finish(r, ret);
+		return 0;
+	}
+
+	if (r->write && cache_enabled())
+		for (size_t j = 0; j < r->n; j++)
+			cache_refresh(r->blockNo + j, r->buf + j * bs);
+
+	r->xfer = 0;
+	pthread_mutex_lock(&a.lock);
+	while (a.inflight >= a.depth) {
+		/* SQEs still queued may be what's taking up the room */
+		if (a.queued > 0) {
+			pthread_mutex_unlock(&a.lock);
+			uring_flush();
+			pthread_mutex_lock(&a.lock);
+			continue;
+		}
+		pthread_cond_wait(&a.room, &a.lock);
+	}
+	a.inflight++;
+
+	if (a.backend == AIO_URING) {
+		uring_queue(r);
+	} else {
+		r->next = NULL;
+		if (a.qTail != NULL)
+			a.qTail->next = r;
+		else
+			a.qHead = r;
+		a.qTail = r;
+		pthread_cond_signal(&a.work);
+	}
+	pthread_mutex_unlock(&a.lock);
+
+	/* a batch's requests go to the kernel together, once it's flushed */
+	return a.backend == AIO_URING && r->batch == NULL ? uring_flush() : 0;
+}
+
+void aio_batch_init(aio_batch *b, size_t blockSize) {
+	b->blockSize = blockSize;
+	b->used = b->pending = 0;
+	b->res				 = 0;
+	pthread_mutex_init(&b->lock, NULL);
+	pthread_cond_init(&b->idle, NULL);
+}
+
+/**
+ * @brief releases a batch; it must have been waited on
+ */
+void aio_batch_destroy(aio_batch *b) {
+	pthread_mutex_destroy(&b->lock);
+	pthread_cond_destroy(&b->idle);
+}
+
+/**
+ * @brief queues a transfer of `n` consecutive blocks as part of `b`; once the
+ * batch is full, its requests are waited on before another is started
+ *
+ * @return 0 on success, negative if the batch has already failed
+ */
+static int batch_add(aio_batch *b, _bool write, size_t blockNo, size_t n,
+					 char *buf, const struct iovec *iov, int iovcnt) {
+	if (b->used == AIO_BATCH && aio_wait(b) != 0)
+		return b->res;
+
+	aio_req *r = &b->reqs[b->used++];
+	*r = (aio_req){.write	  = write,
+				   .blockNo	  = blockNo,
+				   .n		  = n,
+				   .blockSize = b->blockSize,
+				   .buf		  = buf,
+				   .iovcnt	  = iovcnt,
+				   .done	  = NULL,
+				   .batch	  = b};
+	if (iovcnt > 0)
+		memcpy(r->iov, iov, iovcnt * sizeof(*iov));
+
+	pthread_mutex_lock(&b->lock);
+	b->pending++;
+	pthread_mutex_unlock(&b->lock);
+
+	aio_submit(r);
+	return 0;
+}
+
+int aio_read(aio_batch *b, size_t blockNo, size_t n, char *buf) {
+	return batch_add(b, false, blockNo, n, buf, NULL, 0);
+}
+
+/**
+ * @brief aio_read(), scattered over up to AIO_IOV buffers that each take a
+ * whole number of blocks
+ */
+int aio_readv(aio_batch *b, size_t blockNo, size_t n, const struct iovec *iov,
+			  int iovcnt) {
+	return batch_add(b, false, blockNo, n, NULL, iov, MIN(iovcnt, AIO_IOV));
+}
+
+int aio_write(aio_batch *b, size_t blockNo, size_t n, const char *buf) {
+	/* the engine only ever reads from a write's buffer */
+	return batch_add(b, true, blockNo, n, (char *)buf, NULL, 0);
+}
+
+/**
+ * @brief starts the requests queued in `b`, with a single io_uring_enter()
+ * for all of them; requests other batches queued meanwhile go along
+ */
+void aio_flush(aio_batch *b) {
+	(void)b;
+	if (a.backend == AIO_URING)
+		uring_flush();
+}
+
+/**
+ * @return true if every request queued in `b` has completed
+ */
+_bool aio_poll(aio_batch *b) {
+	aio_flush(b);
+	pthread_mutex_lock(&b->lock);
+	_bool idle = b->pending == 0;
+	pthread_mutex_unlock(&b->lock);
+	return idle;
+}
+
+/**
+ * @brief waits for every request queued in `b` to complete, after which the
+ * batch can be reused
+ *
+ * @return 0 if they all succeeded, else the first failure
+ */
+int aio_wait(aio_batch *b) {
+	aio_flush(b);
+	pthread_mutex_lock(&b->lock);
+	while (b->pending > 0)
+		pthread_cond_wait(&b->idle, &b->lock);
+	pthread_mutex_unlock(&b->lock);
+
+	b->used = 0;
+	return b->res;
+}
@@ -0,0 +1,237 @@
+#include "../include/bitmap.h"
+#include "../include/metadata.h"
+#include "../include/utils.h"
+
+/*
+ * Free space is tracked with one bit per block, set while the block is free.
+ * Scans look at a whole 64-bit word at a time, so fully used or fully free
+ * stretches of 64 blocks cost a single comparison.
+ *
+ * Where files share blocks, each block also has a count of the references to
+ * it: a block is handed out with one, and only goes back to the free map once
+ * its last one is dropped.
+ */
+
+#define WORD_BITS 64
+
+size_t bitmap_words(size_t numBlocks) {
+	return (numBlocks + WORD_BITS - 1) / WORD_BITS;
+}
+
+/**
+ * @return the first block at or after `b` whose bit equals `set`, or `limit`
+ * if there is none before it
+ */
+static size_t next_with(size_t b, size_t limit, _bool set,
+						const uint64_t *map) {
+	if (b >= limit)
+		return limit;
+
+	size_t w	  = b / WORD_BITS;
+	uint64_t word = (set ? map[w] : ~map[w]) & (~0ull << (b % WORD_BITS));
+
+	while (word == 0) {
+		if (++w * WORD_BITS >= limit)
+			return limit;
+		word = set ? map[w] : ~map[w];
+	}
+
+	return MIN(w * WORD_BITS + __builtin_ctzll(word), limit);
+}
+
+static void set_run(size_t start, size_t len, _bool set, uint64_t *map) {
+	for (size_t b = start; b < start + len;) {
+		size_t off = b % WORD_BITS, n = MIN(WORD_BITS - off, start + len - b);
+		uint64_t mask = (n == WORD_BITS ? ~0ull : ((1ull << n) - 1)) << off;
+
+		if (set)
+			map[b / WORD_BITS] |= mask;
+		else
+			map[b / WORD_BITS] &= ~mask;
+
+		md_mark_map(b);
+		b += n;
+	}
+}
+
+/**
+ * @brief marks every data block as free
+ *
+ * @param nmb number of metadata blocks
+ */
+void init_free_map(size_t nmb, fs_table *fat, struct fs_settings *const fss) {
+	for (size_t w = 0; w < bitmap_words(fat->size); w++)
+		fat->freeMap[w] = 0;
+
+	if (nmb < fat->size)
+		set_run(nmb, fat->size - nmb, true, fat->freeMap);
+
+	fss->freeBlocks = nmb < fat->size ? fat->size - nmb : 0;
+}
+
+_bool block_is_free(size_t b, const fs_table *fat) {
+	return (fat->freeMap[b / WORD_BITS] >> (b % WORD_BITS)) & 1;
+}
+
+/**
+ * @return the first free run at or after `goal` (wrapping around) at least
+ * `want` blocks long, or failing that, the largest one, SIZE_MAX if there are
+ * none; `len` is set to the number of its blocks to take
+ */
+static size_t find_run(size_t goal, size_t want, size_t *len,
+					   const struct fs_settings *fss, const fs_table *fat) {
+	const size_t nb = fat->size, nmb = fss->numMdBlocks;
+	const uint64_t *map = fat->freeMap;
+
+	/* two passes: [goal, nb) then [nmb, goal) */
+	size_t largest = SIZE_MAX, largestLen = 0;
+	for (int pass = 0; pass < 2; pass++) {
+		size_t b = pass == 0 ? goal : nmb, limit = pass == 0 ? nb : goal;
+
+		while ((b = next_with(b, limit, true, map)) < limit) {
+			size_t e = next_with(b, limit, false, map);
+
+			if (e - b >= want) {
+				*len = want;
+				return b;
+			}
+
+			if (e - b > largestLen) {
+				largest	   = b;
+				largestLen = e - b;
+			}
+
+			b = e;
+		}
+	}
+
+	*len = largestLen;
+	return largest;
+}
+
+/**
+ * @return the number of free blocks starting right at `goal`, up to `want`
+ */
+static size_t free_at(size_t goal, size_t want, const fs_table *fat) {
+	if (!block_is_free(goal, fat))
+		return 0;
+	return next_with(goal, MIN(fat->size, goal + want), false, fat->freeMap) -
+		   goal;
+}
+
+static size_t take(size_t start, size_t len, struct fs_settings *const fss,
+				   const fs_table *fat) {
+	set_run(start, len, false, fat->freeMap);
+	fss->freeBlocks -= len;
+
+	if (fat->refs != NULL) {
+		for (size_t b = start; b < start + len; b++)
+			fat->refs[b] = (block_ref){.refs = 1, .hash = 0};
+		md_mark_refs(start, len);
+	}
+
+	return start;
+}
+
+/**
+ * @brief allocates up to `want` contiguous blocks, preferring (in order):
+ * 	1. the blocks starting right at `goal`, so a file can grow in place
+ * 	2. the first free run at or after `goal` (wrapping around) large enough to
+ * 	   hold all of them
+ * 	3. the largest free run, if none is large enough
+ *
+ * @param goal the block the caller would like to start at; SIZE_MAX if none
+ * @param got number of blocks actually handed out
+ *
+ * @return the first block of the run, SIZE_MAX if there are no free blocks
+ */
+size_t alloc_run(size_t goal, size_t want, size_t *got,
+				 struct fs_settings *const fss, const fs_table *fat) {
+	size_t start, len;
+
+	*got = 0;
+	if (fss->freeBlocks == 0 || want == 0)
+		return SIZE_MAX;
+
+	if (goal < fss->numMdBlocks || goal >= fat->size)
+		goal = fss->numMdBlocks;
+
+	if ((len = free_at(goal, want, fat)) > 0)
+		start = goal;
+	else
+		start = find_run(goal, want, &len, fss, fat);
+
+	*got = len;
+	return take(start, len, fss, fat);
+}
+
+/**
+ * @brief alloc_run(), for exactly `want` contiguous blocks or none at all
+ *
+ * @return the first block of the run, SIZE_MAX if no free run is that long
+ */
+size_t alloc_whole_run(size_t goal, size_t want, struct fs_settings *const fss,
+					   const fs_table *fat) {
+	size_t start, len;
+
+	if (fss->freeBlocks < want || want == 0)
+		return SIZE_MAX;
+
+	if (goal < fss->numMdBlocks || goal >= fat->size)
+		goal = fss->numMdBlocks;
+
+	if ((len = free_at(goal, want, fat)) == want)
+		start = goal;
+	else
+		start = find_run(goal, want, &len, fss, fat);
+
+	return len < want ? SIZE_MAX : take(start, len, fss, fat);
+}
+
+static void release(size_t start, size_t len, struct fs_settings *const fss,
+					const fs_table *fat) {
+	set_run(start, len, true, fat->freeMap);
+	fss->freeBlocks += len;
+	punch_blocks(start, len, fss->blockSize);
+}
+
+/**
+ * @brief drops a reference to each of a run of blocks, returning the ones
+ * left with none to the free map, and their space to the host filesystem if
+ * hole punching is on
+ */
+void free_run(size_t start, size_t len, struct fs_settings *const fss,
+			  const fs_table *fat) {
+	if (fat->refs == NULL) {
+		release(start, len, fss, fat);
+		return;
+	}
+
+	/* blocks still referred to split the run into stretches to free */
+	size_t from = start;
+	for (size_t b = start; b < start + len; b++) {
+		block_ref *r = &fat->refs[b];
+		if (r->refs <= 1) {
+			*r = (block_ref){.refs = 0, .hash = 0};
+			continue;
+		}
+
+		r->refs--;
+		if (b > from)
+			release(from, b - from, fss, fat);
+		from = b + 1;
+	}
+
+	if (start + len > from)
+		release(from, start + len - from, fss, fat);
+	md_mark_refs(start, len);
+}
+
+/**
+ * @brief adds a reference to each of a run of blocks
+ */
+void share_run(size_t start, size_t len, const fs_table *fat) {
+	for (size_t b = start; b < start + len; b++)
+		fat->refs[b].refs++;
+	md_mark_refs(start, len);
+}
@@ -0,0 +1,332 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/cache.h"
+#include "../include/utils.h"
+
+#define SLOT_NONE SIZE_MAX
+
+typedef struct {
+	size_t blockNo; /* block held by this slot; SLOT_NONE if unused */
+	_bool dirty;	/* slot differs from its block on disk */
+	size_t prev;	/* neighbour closer to the MRU end */
+	size_t next;	/* neighbour closer to the LRU end */
+	size_t hNext;	/* next slot in the same hash bucket */
+} cache_slot;
+
+static struct {
+	size_t capacity;
+	size_t blockSize;
+	size_t used;	   /* slots handed out so far */
+	size_t nBuckets;   /* power of two */
+	size_t *buckets;   /* heads of the per-bucket slot chains */
+	cache_slot *slots; /* slot bookkeeping */
+	char *data;		   /* `capacity` blocks, one per slot */
+	size_t mru;		   /* most recently used slot */
+	size_t lru;		   /* least recently used slot */
+	struct cache_stats stats;
+	pthread_mutex_t lock; /* guards everything above once the cache is up */
+} c = {.capacity = 0, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static size_t bucket_of(size_t blockNo) {
+	/* fibonacci hashing spreads sequential block numbers across buckets */
+	return (blockNo * 11400714819323198485ull) & (c.nBuckets - 1);
+}
+
+static char *slot_data(size_t s) { return c.data + s * c.blockSize; }
+
+static size_t lookup(size_t blockNo) {
+	for (size_t s = c.buckets[bucket_of(blockNo)]; s != SLOT_NONE;
+		 s		  = c.slots[s].hNext)
+		if (c.slots[s].blockNo == blockNo)
+			return s;
+	return SLOT_NONE;
+}
+
+static void hash_insert(size_t s) {
+	size_t b		 = bucket_of(c.slots[s].blockNo);
+	c.slots[s].hNext = c.buckets[b];
+	c.buckets[b]	 = s;
+}
+
+static void hash_remove(size_t s) {
+	size_t *p = &c.buckets[bucket_of(c.slots[s].blockNo)];
+	while (*p != s)
+		p = &c.slots[*p].hNext;
+	*p = c.slots[s].hNext;
+}
+
+static void lru_unlink(size_t s) {
+	if (c.slots[s].prev != SLOT_NONE)
+		c.slots[c.slots[s].prev].next = c.slots[s].next;
+	else
+		c.mru = c.slots[s].next;
+
+	if (c.slots[s].next != SLOT_NONE)
+		c.slots[c.slots[s].next].prev = c.slots[s].prev;
+	else
+		c.lru = c.slots[s].prev;
+}
+
+static void lru_push_front(size_t s) {
+	c.slots[s].prev = SLOT_NONE;
+	c.slots[s].next = c.mru;
+	if (c.mru != SLOT_NONE)
+		c.slots[c.mru].prev = s;
+	c.mru = s;
+	if (c.lru == SLOT_NONE)
+		c.lru = s;
+}
+
+static void lru_push_back(size_t s) {
+	c.slots[s].next = SLOT_NONE;
+	c.slots[s].prev = c.lru;
+	if (c.lru != SLOT_NONE)
+		c.slots[c.lru].next = s;
+	c.lru = s;
+	if (c.mru == SLOT_NONE)
+		c.mru = s;
+}
+
+static void touch(size_t s) {
+	if (c.mru == s)
+		return;
+	lru_unlink(s);
+	lru_push_front(s);
+}
+
+static int write_back(size_t s) {
+	if (!c.slots[s].dirty)
+		return 0;
+
+	if (dev_write_block(c.slots[s].blockNo, c.blockSize, slot_data(s)) != 0)
+		return -1;
+
+	c.slots[s].dirty = false;
+	c.stats.writeBacks++;
+	return 0;
+}
+
+/**
+ * @brief hands out a slot for `blockNo`, evicting the least recently used
+ * block (and writing it back if dirty) once every slot is taken
+ *
+ * @return SLOT_NONE if a dirty victim could not be written back
+ */
+static size_t claim_slot(size_t blockNo) {
+	size_t s;
+
+	if (c.used < c.capacity) {
+		s = c.used++;
+	} else {
+		s = c.lru;
+		if (write_back(s) != 0)
+			return SLOT_NONE;
+		if (c.slots[s].blockNo != SLOT_NONE)
+			hash_remove(s);
+		lru_unlink(s);
+	}
+
+	c.slots[s].blockNo = blockNo;
+	c.slots[s].dirty   = false;
+	hash_insert(s);
+	lru_push_front(s);
+	return s;
+}
+
+/**
+ * @brief sets up a write-back cache holding up to `capacity` blocks. A
+ * capacity of 0 leaves the cache disabled, so that read_block() and
+ * write_block() go straight to disk.
+ */
+_bool cache_init(size_t capacity, size_t blockSize) {
+	if (c.capacity > 0)
+		cache_destroy();
+
+	if (capacity == 0)
+		return true;
+
+	size_t nBuckets = 1;
+	while (nBuckets < capacity)
+		nBuckets <<= 1;
+
+	c.buckets = malloc(nBuckets * sizeof(*c.buckets));
+	c.slots	  = malloc(capacity * sizeof(*c.slots));
+	c.data	  = malloc(capacity * blockSize);
+
+	if (c.buckets == NULL || c.slots == NULL || c.data == NULL) {
+		perror("malloc() in cache_init()");
+		free(c.buckets);
+		free(c.slots);
+		free(c.data);
+		return false;
+	}
+
+	for (size_t i = 0; i < nBuckets; i++)
+		c.buckets[i] = SLOT_NONE;
+
+	c.capacity	= capacity;
+	c.blockSize = blockSize;
+	c.nBuckets	= nBuckets;
+	c.used		= 0;
+	c.mru = c.lru = SLOT_NONE;
+	c.stats		  = (struct cache_stats){.capacity = capacity};
+	return true;
+}
+
+/**
+ * @brief writes back every dirty block and releases the cache
+ */
+void cache_destroy(void) {
+	if (c.capacity == 0)
+		return;
+
+	cache_flush();
+	free(c.buckets);
+	free(c.slots);
+	free(c.data);
+	c.capacity = c.used = 0;
+}
+
+_bool cache_enabled(void) { return c.capacity > 0; }
+
+/**
+ * @details on a miss, the block is read with the lock dropped, so threads
+ * missing on different blocks wait on the disk side by side. Where files
+ * share blocks (see dedup.c), readers of different files may miss on the same
+ * one at once; whichever finishes second takes the cached copy. Nothing can
+ * change the block on disk in the meantime, as writers keep every reader out
+ * (see gfs.c).
+ */
+int cache_read(size_t blockNo, char *buf) {
+	pthread_mutex_lock(&c.lock);
+	size_t s = lookup(blockNo);
+
+	if (s != SLOT_NONE) {
+		c.stats.hits++;
+		touch(s);
+		memcpy(buf, slot_data(s), c.blockSize);
+		pthread_mutex_unlock(&c.lock);
+		return 0;
+	}
+
+	c.stats.misses++;
+	pthread_mutex_unlock(&c.lock);
+
+	int ret;
+	if ((ret = dev_read_block(blockNo, c.blockSize, buf)) != 0)
+		return ret;
+
+	/* if another thread cached the block meanwhile, its copy wins */
+	pthread_mutex_lock(&c.lock);
+	if ((s = lookup(blockNo)) != SLOT_NONE)
+		memcpy(buf, slot_data(s), c.blockSize);
+	else if ((s = claim_slot(blockNo)) != SLOT_NONE)
+		memcpy(slot_data(s), buf, c.blockSize);
+	pthread_mutex_unlock(&c.lock);
+
+	return 0;
+}
+
+/**
+ * @details the whole block is overwritten, so a miss never needs to read the
+ * old contents in; the block is only written out on eviction or flush
+ */
+int cache_write(size_t blockNo, const char *buf) {
+	pthread_mutex_lock(&c.lock);
+	size_t s = lookup(blockNo);
+
+	if (s != SLOT_NONE) {
+		c.stats.hits++;
+		touch(s);
+	} else {
+		c.stats.misses++;
+		if ((s = claim_slot(blockNo)) == SLOT_NONE) {
+			pthread_mutex_unlock(&c.lock);
+			return -3;
+		}
+	}
+
+	memcpy(slot_data(s), buf, c.blockSize);
+	c.slots[s].dirty = true;
+	pthread_mutex_unlock(&c.lock);
+	return 0;
+}
+
+/**
+ * @brief copies a block out of the cache only if it's already there, without
+ * touching the LRU order; lets multi-block reads that bypass the cache still
+ * see blocks that haven't been written back yet
+ *
+ * @return true if the block was cached
+ */
+_bool cache_peek(size_t blockNo, char *buf) {
+	pthread_mutex_lock(&c.lock);
+	size_t s = lookup(blockNo);
+	if (s != SLOT_NONE)
+		memcpy(buf, slot_data(s), c.blockSize);
+	pthread_mutex_unlock(&c.lock);
+
+	return s != SLOT_NONE;
+}
+
+/**
+ * @brief replaces the cached copy of a block, if there is one, with contents
+ * that were just written to disk around the cache; the copy is clean from
+ * then on
+ */
+void cache_refresh(size_t blockNo, const char *buf) {
+	pthread_mutex_lock(&c.lock);
+	size_t s = lookup(blockNo);
+	if (s != SLOT_NONE) {
+		memcpy(slot_data(s), buf, c.blockSize);
+		c.slots[s].dirty = false;
+	}
+	pthread_mutex_unlock(&c.lock);
+}
+
+/**
+ * @brief forgets a block without writing it back, e.g because it was freed;
+ * its slot is the next one to be reused
+ */
+void cache_discard(size_t blockNo) {
+	if (c.capacity == 0)
+		return;
+
+	pthread_mutex_lock(&c.lock);
+	size_t s = lookup(blockNo);
+	if (s != SLOT_NONE) {
+		hash_remove(s);
+		lru_unlink(s);
+		c.slots[s].blockNo = SLOT_NONE;
+		c.slots[s].dirty   = false;
+		lru_push_back(s);
+	}
+	pthread_mutex_unlock(&c.lock);
+}
+
+/**
+ * @brief writes every dirty block back to disk, keeping them cached
+ *
+ * @return 0 on success, negative if any block failed to be written
+ */
+int cache_flush(void) {
+	int ret = 0;
+
+	pthread_mutex_lock(&c.lock);
+	for (size_t s = 0; s < c.used; s++)
+		if (c.slots[s].blockNo != SLOT_NONE && write_back(s) != 0)
+			ret = -1;
+	pthread_mutex_unlock(&c.lock);
+
+	return ret;
+}
+
+struct cache_stats cache_get_stats(void) {
+	pthread_mutex_lock(&c.lock);
+	struct cache_stats stats = c.stats;
+	pthread_mutex_unlock(&c.lock);
+
+	return stats;
+}
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/bitmap.h"
+#include "../include/dedup.h"
+#include "../include/extent.h"
+#include "../include/metadata.h"
+#include "../include/utils.h"
+
+/*
+ * In a filesystem that shares blocks, each block has a count of the
+ * references extent records make to it (see bitmap.c), so one block can be
+ * part of any number of files, or of one file many times over. A block with
+ * more than one reference is never written to: a write that changes it gives
+ * the file a block of its own instead, and drops its reference to the shared
+ * one.
+ *
+ * Whole blocks are deduplicated as they're written. The content of each is
+ * hashed and looked up in the dedup index; if a block with the same content
+ * is found, the file takes a reference to it rather than a new block. Hashes
+ * only narrow the search down: a candidate is read back and compared before
+ * it's shared, so blocks that merely hash alike are never mixed up. A block
+ * written again with the content it already holds isn't written at all.
+ *
+ * The hash of each block in the index is persisted in its block reference,
+ * next to the FAT. The index itself, from hashes to blocks, is only kept in
+ * memory, and built from those on the first write after mounting. It is an
+ * open-addressing table that's never removed from: a block that was freed, or
+ * rewritten with other content, no longer matches the hash it was filed
+ * under, so lookups pass it over, and its slot goes to the next block
+ * inserted on the way. The table is built over whenever slots fill up.
+ *
+ * The last block of a file that doesn't end on a block boundary isn't whole,
+ * so it's never in the index.
+ */
+
+#define EMPTY_SLOT NIL_IDX
+
+static struct {
+	uint32_t *slots; /* blocks, EMPTY_SLOT if none; NULL until first use */
+	size_t cap;		 /* number of slots; a power of two */
+	size_t used;	 /* slots that aren't empty */
+} idx = {.slots = NULL};
+
+/* Whole blocks from the caller's buffer, written out together once the next
+ * one doesn't follow on from them, on disk and in the buffer */
+typedef struct {
+	size_t start; /* first block */
+	size_t n;	  /* blocks in the run; 0 if there's none */
+	const char *src;
+	size_t bs;
+} pending_run;
+
+/**
+ * @return a hash of a block's content; never 0, which marks blocks outside
+ * the index
+ */
+static uint32_t block_hash(const char *data, size_t bs) {
+	uint64_t h = 0x9E3779B97F4A7C15ull, w;
+	size_t off = 0;
+
+	for (; off + sizeof(w) <= bs; off += sizeof(w)) {
+		memcpy(&w, data + off, sizeof(w));
+		h = (h ^ w) * 0xFF51AFD7ED558CCDull;
+		h ^= h >> 29;
+	}
+
+	for (; off < bs; off++)
+		h = (h ^ (uint8_t)data[off]) * 0x100000001B3ull;
+
+	const uint32_t v = h ^ (h >> 32);
+	return v != 0 ? v : 1;
+}
+
+/**
+ * @return whether slot `s` may be given to a block with hash `h`: it's empty,
+ * or its block is out of the index, or has that same hash, and so is
+ * superseded
+ */
+static _bool slot_free(size_t s, uint32_t h, const fs_table *fat) {
+	const uint32_t b = idx.slots[s];
+	return b == EMPTY_SLOT || fat->refs[b].refs == 0 ||
+		   fat->refs[b].hash == 0 || fat->refs[b].hash == h;
+}
+
+/**
+ * @brief files block `b` under the hash in its reference, in the first slot
+ * on the way that slot_free() allows
+ */
+static void insert(size_t b, const fs_table *fat) {
+	const uint32_t h  = fat->refs[b].hash;
+	const size_t mask = idx.cap - 1;
+
+	for (size_t s = h & mask, n = 0; n < idx.cap; s = (s + 1) & mask, n++) {
+		if (!slot_free(s, h, fat))
+			continue;
+
+		if (idx.slots[s] == EMPTY_SLOT)
+			idx.used++;
+		idx.slots[s] = b;
+		return;
+	}
+}
+
+/**
+ * @brief (re)builds the index from the hashes in the block references, with
+ * twice as many slots as there are blocks; the index stays unused if it can't
+ * be allocated
+ */
+static void build(const fs_table *fat) {
+	if (idx.slots == NULL) {
+		for (idx.cap = 64; idx.cap < 2 * fat->size;)
+			idx.cap *= 2;
+
+		if ((idx.slots = malloc(idx.cap * sizeof(*idx.slots))) == NULL) {
+			perror("malloc() in build()");
+			return;
+		}
+	}
+
+	memset(idx.slots, 0xFF, idx.cap * sizeof(*idx.slots)); /* EMPTY_SLOT */
+	idx.used = 0;
+
+	for (size_t b = 0; b < fat->size; b++)
+		if (fat->refs[b].refs > 0 && fat->refs[b].hash != 0)
+			insert(b, fat);
+}
+
+/**
+ * @return the block filed under hash `h`, SIZE_MAX if there's none
+ */
+static size_t find(uint32_t h, const fs_table *fat) {
+	const size_t mask = idx.cap - 1;
+
+	for (size_t s = h & mask, n = 0; idx.slots != NULL && n < idx.cap;
+		 s = (s + 1) & mask, n++) {
+		const uint32_t b = idx.slots[s];
+		if (b == EMPTY_SLOT)
+			break;
+		if (fat->refs[b].refs > 0 && fat->refs[b].hash == h)
+			return b;
+	}
+
+	return SIZE_MAX;
+}
+
+/**
+ * @brief records that block `b` holds content with hash `h`, filing it in the
+ * index; 0 takes it out instead
+ */
+static void set_hash(size_t b, uint32_t h, const fs_table *fat) {
+	fat->refs[b].hash = h;
+	md_mark_refs(b, 1);
+
+	if (h == 0 || idx.slots == NULL)
+		return;
+
+	insert(b, fat);
+	if (idx.used * 4 > idx.cap * 3)
+		build(fat);
+}
+
+/**
+ * @brief forgets the index, e.g because the filesystem was formatted or is
+ * going away
+ */
+void dedup_reset(void) {
+	free(idx.slots);
+	idx.slots = NULL;
+	idx.cap = idx.used = 0;
+}
+
+/**
+ * @return 0 on success, -5 if the run couldn't be written
+ */
+static int flush(pending_run *p) {
+	if (p->n == 0)
+		return 0;
+
+	const size_t n = p->n;
+	p->n		   = 0;
+	return write_blocks(p->start, n, p->bs, p->src) == 0 ? 0 : -5;
+}
+
+/**
+ * @brief writes `data` to block `b`: as part of the pending run, unless it's
+ * in a buffer of the caller's own that is about to be reused, in which case
+ * it's written straight away
+ *
+ * @return 0 on success, -5 on failure
+ */
+static int put(pending_run *p, size_t b, const char *data, _bool reused) {
+	if (p->n > 0 && b == p->start + p->n && data == p->src + p->n * p->bs) {
+		p->n++;
+		return 0;
+	}
+
+	if (flush(p) != 0)
+		return -5;
+
+	if (reused)
+		return write_block(b, p->bs, data) == 0 ? 0 : -5;
+
+	*p = (pending_run){.start = b, .n = 1, .src = data, .bs = p->bs};
+	return 0;
+}
+
+/**
+ * @brief writes a buf of data to a file at `fPos` in a filesystem that
+ * shares blocks, a block at a time. Each block the write changes goes to, in
+ * order of preference:
+ * 	1. a block that already holds the same content, if it's whole
+ * 	2. the block it's in, unless anything else refers to that too
+ * 	3. a new block, as close after the file's previous one as can be
+ * The file's extent list is then brought in line with its block map, over the
+ * blocks that changed.
+ *
+ * @return 0 on success, negative on failure; whatever was written by then is
+ * kept
+ */
+int write_shared(size_t i, const char *buf, size_t size,
+				 struct fs_settings *fss, size_t fPos, const fs_table *dt,
+				 const fs_table *fat) {
+	dir_entry *e	   = &dt->dirs[i];
+	file_state *f	   = &dt->files[i];
+	const size_t bs	   = fss->blockSize, end = fPos + size;
+	const size_t first = fPos / bs, last = (end - 1) / bs;
+	const size_t oldSize = e->size, newSize = MAX(oldSize, end);
+
+	if (get_block_map(i, fss, dt, fat) == NULL && e->firstBlockIdx != NIL_IDX)
+		return -8;
+
+	if (last >= fss->fMaxBlocks) {
+		fprintf(stderr, ERR_FILE_MAX_BLOCKS, fss->fMaxBlocks);
+		return -6;
+	}
+
+	/* every block may end up in a run of its own, and a run be cut in two */
+	if (!reserve_block_map(i, last + 1, dt))
+		return -8;
+	get_run_index(i, dt, fat); /* without one, the list is walked instead */
+	if (!has_spare_records(last - first + 2, fss, fat)) {
+		fprintf(stderr, "write_shared(): extent table exhausted\n");
+		return -8;
+	}
+
+	if (idx.slots == NULL)
+		build(fat);
+
+	char blk[bs], cand[bs];
+	pending_run p = {.n = 0, .bs = bs};
+	size_t from = SIZE_MAX, to = 0; /* blocks of the file that changed */
+	size_t k	= first;
+	int ret		= 0;
+
+	for (; k <= last; k++) {
+		const size_t bStart = k * bs, lo = k == first ? fPos - bStart : 0;
+		const size_t hi	 = MIN(bs, end - bStart);
+		const size_t old = k < f->mapLen ? f->blockMap[k] : SIZE_MAX;
+		const char *data = blk;
+
+		/* a block the write only covers part of is put together in `blk`;
+		 * only bytes of the file the write leaves alone need reading */
+		if (lo == 0 && hi == bs) {
+			data = buf + (bStart - fPos);
+		} else {
+			size_t live = oldSize > bStart ? MIN(bs, oldSize - bStart) : 0;
+			if (old != SIZE_MAX && (lo > 0 || hi < live)) {
+				if ((ret = flush(&p)) != 0)
+					break;
+				if (read_block(old, bs, blk) != 0) {
+					ret = -4;
+					break;
+				}
+			} else {
+				memset(blk, 0, bs);
+			}
+
+			memcpy(blk + lo, buf + (bStart + lo - fPos), hi - lo);
+		}
+
+		/* a candidate is only taken if its content really is the same */
+		const uint32_t h = bStart + bs <= newSize ? block_hash(data, bs) : 0;
+		size_t b		 = h != 0 ? find(h, fat) : SIZE_MAX;
+		if (b != SIZE_MAX) {
+			if ((ret = flush(&p)) != 0)
+				break;
+			if (read_block(b, bs, cand) != 0) {
+				ret = -4;
+				break;
+			}
+			if (memcmp(cand, data, bs) != 0)
+				b = SIZE_MAX;
+		}
+
+		if (b != SIZE_MAX && b == old)
+			continue;
+
+		if (b != SIZE_MAX) {
+			share_run(b, 1, fat);
+		} else {
+			if (old != SIZE_MAX && fat->refs[old].refs == 1) {
+				b = old;
+			} else {
+				size_t goal = k > 0 ? f->blockMap[k - 1] + 1 : SIZE_MAX, got;
+				if ((b = alloc_run(goal, 1, &got, fss, fat)) == SIZE_MAX) {
+					fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
+					ret = -7;
+					break;
+				}
+			}
+
+			ret = put(&p, b, data, data == blk);
+			set_hash(b, ret == 0 ? h : 0, fat);
+			if (ret != 0) {
+				if (b != old)
+					free_run(b, 1, fss, fat);
+				break;
+			}
+		}
+
+		if (b == old)
+			continue;
+
+		f->blockMap[k] = b;
+		if (k == f->mapLen)
+			f->mapLen++;
+		if (old != SIZE_MAX)
+			free_run(old, 1, fss, fat);
+
+		from = MIN(from, k);
+		to	 = k + 1;
+	}
+
+	/* the data must be down before the journal commits the metadata */
+	if (flush(&p) != 0 && ret == 0)
+		ret = -5;
+
+	if (from < to)
+		remap_runs(&e->firstBlockIdx, f->blockMap, from, to, f->runOf, fss,
+				   fat);
+
+	/* the file grows by as much as the write got through */
+	const size_t done = MIN(end, k * bs);
+	if (done > oldSize)
+		e->size = done;
+	md_mark_dir(i);
+
+	return ret;
+}
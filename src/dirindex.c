@@ -0,0 +1,191 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/dirindex.h"
+#include "../include/names.h"
+
+#define SLOT_EMPTY SIZE_MAX
+#define SLOT_TOMB  (SIZE_MAX - 1)
+
+/*
+ * An index over a paged-in table is only filled in when it's first used, so
+ * that mounting doesn't read every entry. Lookups run under the metadata read
+ * lock, so the first of them to get there fills it in under `fill`, and the
+ * rest wait for it.
+ */
+
+/**
+ * @brief FNV-1a over the name, seeded with the parent's index
+ */
+static size_t hash_key(const char *name, unsigned short nameLen,
+					   size_t parent) {
+	uint64_t h = 14695981039346656037ull ^ parent;
+	h *= 1099511628211ull;
+
+	for (unsigned short j = 0; j < nameLen; j++) {
+		h ^= (unsigned char)name[j];
+		h *= 1099511628211ull;
+	}
+
+	return h;
+}
+
+static _bool matches(size_t i, const char *name, unsigned short nameLen,
+					 size_t parent, const fs_table *dt) {
+	const dir_entry *e = &dt->dirs[i];
+	return e->valid && e->parentIdx == parent && e->nameLen == nameLen &&
+		   memcmp(entry_name(dt, e), name, nameLen) == 0;
+}
+
+static void place(size_t i, const fs_table *dt) {
+	dir_index *x	   = dt->index;
+	const dir_entry *e = &dt->dirs[i];
+	size_t s =
+		hash_key(entry_name(dt, e), e->nameLen, e->parentIdx) & (x->cap - 1);
+
+	while (x->slots[s] != SLOT_EMPTY && x->slots[s] != SLOT_TOMB)
+		s = (s + 1) & (x->cap - 1);
+
+	if (x->slots[s] == SLOT_TOMB)
+		x->tombs--;
+	x->slots[s] = i;
+	x->live++;
+}
+
+/**
+ * @brief re-inserts every valid entry, clearing out tombstones
+ */
+static void rehash(const fs_table *dt) {
+	dir_index *x = dt->index;
+
+	for (size_t s = 0; s < x->cap; s++)
+		x->slots[s] = SLOT_EMPTY;
+	x->live = x->tombs = 0;
+
+	for (size_t i = 0; i < dt->size; i++)
+		if (dt->dirs[i].valid)
+			place(i, dt);
+}
+
+/**
+ * @brief fills the index in, if it's yet to be
+ */
+static void ensure_built(const fs_table *dt) {
+	dir_index *x = dt->index;
+	if (__atomic_load_n(&x->built, __ATOMIC_ACQUIRE))
+		return;
+
+	pthread_mutex_lock(&x->fill);
+	if (!x->built) {
+		rehash(dt);
+
+		x->freeHint = 1;
+		while (x->freeHint < dt->size && dt->dirs[x->freeHint].valid)
+			x->freeHint++;
+
+		__atomic_store_n(&x->built, true, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&x->fill);
+}
+
+/**
+ * @brief (re)builds the name index over the whole directory table, or only
+ * sets it up to be filled in on first use if `deferred`. The table is sized
+ * at twice the entry count, so it never has to grow.
+ */
+_bool build_dir_index(fs_table *dt, _bool deferred) {
+	free_dir_index(dt);
+
+	dir_index *x = malloc(sizeof(*x));
+	if (x == NULL) {
+		perror("malloc() in build_dir_index()");
+		return false;
+	}
+
+	x->cap = 1;
+	while (x->cap < dt->size * 2)
+		x->cap <<= 1;
+
+	if ((x->slots = malloc(x->cap * sizeof(*x->slots))) == NULL) {
+		perror("malloc() in build_dir_index()");
+		free(x);
+		return false;
+	}
+
+	x->built = false;
+	pthread_mutex_init(&x->fill, NULL);
+	dt->index = x;
+
+	if (!deferred)
+		ensure_built(dt);
+	return true;
+}
+
+void free_dir_index(fs_table *dt) {
+	if (dt->index == NULL)
+		return;
+
+	pthread_mutex_destroy(&dt->index->fill);
+	free(dt->index->slots);
+	free(dt->index);
+	dt->index = NULL;
+}
+
+/**
+ * @return the entry called `name` under `parent`; SIZE_MAX if there is none
+ */
+size_t dir_index_find(const char *name, unsigned short nameLen, size_t parent,
+					  const fs_table *dt) {
+	const dir_index *x = dt->index;
+	size_t s		   = hash_key(name, nameLen, parent) & (x->cap - 1);
+	ensure_built(dt);
+
+	for (; x->slots[s] != SLOT_EMPTY; s = (s + 1) & (x->cap - 1))
+		if (x->slots[s] != SLOT_TOMB &&
+			matches(x->slots[s], name, nameLen, parent, dt))
+			return x->slots[s];
+
+	return SIZE_MAX;
+}
+
+/**
+ * @pre entry `i` is valid and holds its final parent and name
+ */
+void dir_index_insert(size_t i, const fs_table *dt) {
+	if (dt->index == NULL)
+		return;
+	ensure_built(dt);
+
+	/* probe sequences only end at empty slots, so keep enough of them; a
+	 * rehash picks `i` up along with everything else */
+	if ((dt->index->live + dt->index->tombs + 1) * 4 > dt->index->cap * 3)
+		rehash(dt);
+	else
+		place(i, dt);
+}
+
+/**
+ * @pre entry `i` still holds the parent and name it was inserted with
+ */
+void dir_index_remove(size_t i, const fs_table *dt) {
+	dir_index *x = dt->index;
+	if (x == NULL)
+		return;
+	ensure_built(dt);
+
+	const dir_entry *e = &dt->dirs[i];
+	size_t s =
+		hash_key(entry_name(dt, e), e->nameLen, e->parentIdx) & (x->cap - 1);
+
+	for (; x->slots[s] != SLOT_EMPTY; s = (s + 1) & (x->cap - 1)) {
+		if (x->slots[s] == i) {
+			x->slots[s] = SLOT_TOMB;
+			x->live--;
+			x->tombs++;
+			break;
+		}
+	}
+
+	if (i < x->freeHint)
+		x->freeHint = i;
+}
@@ -0,0 +1,238 @@
+#include <stdio.h>
+
+#include "../include/bitmap.h"
+#include "../include/extent.h"
+#include "../include/metadata.h"
+
+/*
+ * In extent mode the table that would otherwise hold the FAT holds extent
+ * records instead. Each record describes a run of contiguous blocks and links
+ * to the next record of the same list. Two kinds of lists share the table:
+ *  - every file's runs, in file order, headed by its `firstBlockIdx`
+ *  - the spare records, headed by `freeExtPtr`
+ * Runs are never empty and, unless files share blocks, disjoint, so there
+ * are always fewer runs than blocks, i.e the table never runs out of records.
+ * Shared blocks may be in any number of runs (see dedup.c), so there the
+ * table can be exhausted. Free blocks themselves are tracked by the free map
+ * (see bitmap.c).
+ */
+
+static size_t new_record(struct fs_settings *const fss, const fs_table *runs) {
+	size_t e = fss->freeExtPtr;
+	if (e != NIL_IDX)
+		fss->freeExtPtr = runs->runs[e].next;
+	return e;
+}
+
+static void release_record(size_t e, struct fs_settings *const fss,
+						   const fs_table *runs) {
+	runs->runs[e].next = fss->freeExtPtr;
+	fss->freeExtPtr	   = e;
+	md_mark_fat(e);
+}
+
+/**
+ * @brief marks every record of the extent table as spare
+ */
+void init_extent_table(fs_table *runs, struct fs_settings *const fss) {
+	for (size_t i = 0; i < runs->size; i++)
+		runs->runs[i] = (extent){.start = 0, .len = 0, .next = i + 1};
+	runs->runs[runs->size - 1].next = NIL_IDX;
+
+	fss->freeExtPtr = 0;
+}
+
+/**
+ * @brief appends a run of blocks to the end of a file's extent list, growing
+ * its last run instead if the new blocks directly follow it
+ */
+_bool append_run(uint32_t *firstExt, size_t start, size_t len,
+				 struct fs_settings *const fss, const fs_table *runs) {
+	extent *r	= runs->runs;
+	size_t last = *firstExt;
+
+	if (last != NIL_IDX) {
+		while (r[last].next != NIL_IDX)
+			last = r[last].next;
+
+		if (r[last].start + r[last].len == start) {
+			r[last].len += len;
+			md_mark_fat(last);
+			return true;
+		}
+	}
+
+	size_t n = new_record(fss, runs);
+	if (n == NIL_IDX) {
+		fprintf(stderr, "append_run(): extent table exhausted\n");
+		return false;
+	}
+
+	r[n] = (extent){.start = start, .len = len, .next = NIL_IDX};
+	md_mark_fat(n);
+
+	if (last == NIL_IDX) {
+		*firstExt = n;
+	} else {
+		r[last].next = n;
+		md_mark_fat(last);
+	}
+
+	return true;
+}
+
+/**
+ * @brief links a record for a run of blocks into a file's extent list right
+ * after record `after`, or at its head if that's NIL_IDX; unlike append_run(),
+ * the run is kept apart from its neighbours even if they're adjacent
+ *
+ * @return the new record, NIL_IDX if the table is exhausted
+ */
+size_t insert_run(uint32_t *firstExt, size_t after, size_t start, size_t len,
+				  struct fs_settings *const fss, const fs_table *runs) {
+	extent *r = runs->runs;
+	size_t n  = new_record(fss, runs);
+	if (n == NIL_IDX) {
+		fprintf(stderr, "insert_run(): extent table exhausted\n");
+		return NIL_IDX;
+	}
+
+	r[n] = (extent){.start = start, .len = len};
+	if (after == NIL_IDX) {
+		r[n].next = *firstExt;
+		*firstExt = n;
+	} else {
+		r[n].next	  = r[after].next;
+		r[after].next = n;
+		md_mark_fat(after);
+	}
+
+	md_mark_fat(n);
+	return n;
+}
+
+/**
+ * @return whether the table has at least `n` spare records
+ */
+_bool has_spare_records(size_t n, const struct fs_settings *fss,
+						const fs_table *runs) {
+	size_t e = fss->freeExtPtr;
+	for (; n > 0 && e != NIL_IDX; n--)
+		e = runs->runs[e].next;
+	return n == 0;
+}
+
+/**
+ * @brief makes blocks [from, to) of a file's extent list those of
+ * `map[from..to)`, cutting the records that straddle either end, and
+ * replacing the ones in between; the blocks they described are left as they
+ * are. The list may end anywhere past `from`, and is extended if need be.
+ *
+ * @param runOf the file's run index (see get_run_index()), kept up to date;
+ * with it the records around the range are found directly rather than by
+ * walking the list, and a record straddling `from` gives up whichever of its
+ * ends is shorter, so a write costs what it touches, not what the list
+ * holds. NULL to walk the list from its head instead.
+ *
+ * @pre the table has a spare record for each run of adjacent blocks in the
+ * range of `map`, plus one; `map[0..from)` still matches the list
+ */
+void remap_runs(uint32_t *firstExt, const size_t *map, size_t from, size_t to,
+				uint32_t *runOf, struct fs_settings *const fss,
+				const fs_table *runs) {
+	extent *r	= runs->runs;
+	size_t prev = NIL_IDX, e = *firstExt, pos = 0;
+
+	if (runOf != NULL && from > 0) {
+		e	= runOf[from - 1];
+		pos = from - 1 - (map[from - 1] - r[e].start);
+		if (pos + r[e].len == from) {
+			prev = e;
+			e	 = r[e].next;
+			pos	 = from;
+		} else {
+			prev = pos > 0 ? runOf[pos - 1] : NIL_IDX;
+		}
+	}
+
+	while (e != NIL_IDX && pos + r[e].len <= from) {
+		pos += r[e].len;
+		prev = e;
+		e	 = r[e].next;
+	}
+
+	/* keep the part of the first record before the range to itself */
+	if (e != NIL_IDX && pos < from) {
+		const size_t head = from - pos;
+		if (runOf != NULL && head < r[e].len - head) {
+			size_t h = insert_run(firstExt, prev, r[e].start, head, fss, runs);
+			for (size_t k = pos; k < from; k++)
+				runOf[k] = h;
+			r[e].start += head;
+			r[e].len -= head;
+			md_mark_fat(e);
+			prev = h;
+		} else {
+			size_t t = insert_run(firstExt, e, r[e].start + head,
+								  r[e].len - head, fss, runs);
+			r[e].len = head;
+			md_mark_fat(e);
+			prev = e;
+			e	 = t;
+		}
+		pos = from;
+	}
+
+	/* drop the records inside it, and the front of one running past it */
+	while (e != NIL_IDX && pos < to) {
+		const size_t next = r[e].next;
+		if (pos + r[e].len > to) {
+			r[e].start += to - pos;
+			r[e].len -= to - pos;
+			md_mark_fat(e);
+			if (runOf != NULL && runOf[to] != e)
+				for (size_t k = to; k < to + r[e].len; k++)
+					runOf[k] = e;
+			break;
+		}
+
+		pos += r[e].len;
+		release_record(e, fss, runs);
+		e = next;
+	}
+
+	if (prev == NIL_IDX) {
+		*firstExt = e;
+	} else {
+		r[prev].next = e;
+		md_mark_fat(prev);
+	}
+
+	for (size_t k = from, n; k < to; k += n) {
+		for (n = 1; k + n < to && map[k + n] == map[k] + n;)
+			n++;
+
+		if (prev != NIL_IDX && r[prev].start + r[prev].len == map[k]) {
+			r[prev].len += n;
+			md_mark_fat(prev);
+		} else {
+			prev = insert_run(firstExt, prev, map[k], n, fss, runs);
+		}
+
+		if (runOf != NULL)
+			for (size_t j = k; j < k + n; j++)
+				runOf[j] = prev;
+	}
+}
+
+/**
+ * @brief frees every run of a file along with the records describing them
+ */
+void release_extent_list(size_t firstExt, struct fs_settings *const fss,
+						 const fs_table *runs) {
+	for (size_t e = firstExt, next; e != NIL_IDX; e = next) {
+		next = runs->runs[e].next;
+		free_run(runs->runs[e].start, runs->runs[e].len, fss, runs);
+		release_record(e, fss, runs);
+	}
+}
@@ -1,73 +1,429 @@
+#include <fcntl.h>
 #include <stdio.h>
 #include <string.h>
 #include <unistd.h>
 
+#include "../include/aio.h"
+#include "../include/bitmap.h"
+#include "../include/cache.h"
+#include "../include/dedup.h"
 #include "../include/defaults.h"
+#include "../include/dirindex.h"
+#include "../include/extent.h"
 #include "../include/filesystem.h"
+#include "../include/journal.h"
+#include "../include/metadata.h"
+#include "../include/names.h"
+#include "../include/readahead.h"
 #include "../include/utils.h"
+#include "../include/zcluster.h"
 
-extern FILE *fs;
+extern int fs;
 extern char *optarg;
 extern int optind;
 
 /**
- * @brief 'increments' the free list chain by one
- */
-void increment_free_list_ptr(struct fs_settings *const fss,
-							 const fs_table *const fat) {
-	if (fss->freeListPtr != SIZE_MAX)
-		fss->freeListPtr = fat->blocks[fss->freeListPtr].next;
-}
-
-/**
- * @brief return the index of an entry in a directory table
+ * @brief return the index of an entry in a directory table, through the name
+ * index if there is one
  *
  * @return SIZE_MAX if the name being searched for was not found
  */
 size_t get_index_of_dir_entry(const char *name, size_t cwd,
 							  const fs_table *dt) {
-	unsigned short nameLen = strlen(name);
+	const size_t nameLen = strlen(name);
+
+	/* no entry can have a longer one */
+	if (nameLen > MAX_NAME_LEN)
+		return SIZE_MAX;
+
+	if (dt->index != NULL)
+		return dir_index_find(name, nameLen, cwd, dt);
 
 	for (size_t i = 0; i < dt->size; i++)
 		if (dt->dirs[i].valid && dt->dirs[i].nameLen == nameLen &&
 			dt->dirs[i].parentIdx == cwd &&
-			strncmp(name, dt->dirs[i].name, nameLen) == 0)
+			strncmp(name, entry_name(dt, &dt->dirs[i]), nameLen) == 0)
 			return i;
 
 	return SIZE_MAX;
 }
 
+/**
+ * @brief appends entry `i` to its parent's list of children
+ */
+static void link_child(size_t i, const fs_table *dt) {
+	dir_entry *p = &dt->dirs[dt->dirs[i].parentIdx];
+	dir_entry *e = &dt->dirs[i];
+
+	e->nextSibling = NIL_IDX;
+	md_mark_dir(i);
+
+	if (p->firstChild == NIL_IDX) {
+		p->firstChild  = i;
+		e->prevSibling = i;
+		md_mark_dir(e->parentIdx);
+		return;
+	}
+
+	dir_entry *first = &dt->dirs[p->firstChild];
+	size_t last		 = first->prevSibling;
+
+	e->prevSibling			   = last;
+	dt->dirs[last].nextSibling = i;
+	first->prevSibling		   = i;
+	md_mark_dir(last);
+	md_mark_dir(p->firstChild);
+}
+
+/**
+ * @brief takes entry `i` out of its parent's list of children
+ */
+static void unlink_child(size_t i, const fs_table *dt) {
+	dir_entry *p = &dt->dirs[dt->dirs[i].parentIdx];
+	dir_entry *e = &dt->dirs[i];
+
+	if (p->firstChild == i) {
+		p->firstChild = e->nextSibling;
+		md_mark_dir(e->parentIdx);
+	} else {
+		dt->dirs[e->prevSibling].nextSibling = e->nextSibling;
+		md_mark_dir(e->prevSibling);
+	}
+
+	/* the first child's back link points at the last one */
+	size_t fixup = e->nextSibling != NIL_IDX ? e->nextSibling : p->firstChild;
+	if (fixup != NIL_IDX) {
+		dt->dirs[fixup].prevSibling = e->prevSibling;
+		md_mark_dir(fixup);
+	}
+
+	e->nextSibling = e->prevSibling = NIL_IDX;
+	md_mark_dir(i);
+}
+
 /**
  * @brief creates a new file or directory under the parent directory at
- * `cwd` index, if a free entry is found. `name` must point to a
- * heap-allocated string.
+ * `cwd` index, if a free entry is found. `name` is copied into the name heap.
  */
-_bool create_dir_entry(char *name, size_t cwd, _bool isDir, const fs_table *dt) {
+_bool create_dir_entry(const char *name, size_t cwd, _bool isDir,
+					   const fs_table *dt) {
+	/* a name that can't be stored is turned away before anything moves */
+	const size_t nameLen = strlen(name);
+	if (nameLen > MAX_NAME_LEN)
+		return false;
+
 	/* find free spot & and verify we don't exist already */
 	if (get_index_of_dir_entry(name, cwd, dt) != SIZE_MAX)
 		return false;
 
-	size_t i = 1;
+	size_t i = dt->index != NULL ? dt->index->freeHint : 1;
 	for (; i < dt->size; i++)
 		if (!dt->dirs[i].valid)
 			break;
 
-	size_t nameLen = strlen(name);
+	if (dt->index != NULL)
+		dt->index->freeHint = i;
 
-	if (i == dt->size || nameLen > MAX_NAME_LEN)
+	if (i == dt->size)
 		return false;
 
+	md_begin_op();
 	dt->dirs[i] = (dir_entry){.valid		 = true,
 							  .isDir		 = isDir,
-							  .nameLen		 = nameLen,
-							  .name			 = name,
 							  .size			 = 0,
 							  .parentIdx	 = cwd,
-							  .firstBlockIdx = SIZE_MAX};
+							  .firstBlockIdx = NIL_IDX,
+							  .firstChild	 = NIL_IDX};
+
+	if (!store_name(i, name, nameLen, dt)) {
+		dt->dirs[i] = DIR_TABLE_GARBAGE_ENTRY;
+		md_end_op();
+		return false;
+	}
+
+	link_child(i, dt);
+	dir_index_insert(i, dt);
+	md_end_op();
+
+	return true;
+}
+
+/**
+ * @brief returns the file's block map, walking its FAT chain to build it on
+ * first use. The map is kept in sync by write_to_file() and truncate_file(),
+ * so the k'th block of a file is always one array lookup away. A compressed
+ * file's map holds the records of its clusters instead (see zcluster.c).
+ *
+ * @return NULL if the file has no blocks or the map couldn't be allocated
+ */
+size_t *get_block_map(size_t i, struct fs_settings *fss, const fs_table *dt,
+					  const fs_table *fat) {
+	file_state *f = &dt->files[i];
+	size_t first  = dt->dirs[i].firstBlockIdx;
+
+	if (f->blockMap != NULL || first == NIL_IDX)
+		return f->blockMap;
+
+	size_t n = 0;
+	if (fss->compMode != COMP_OFF)
+		for (size_t e = first; e != NIL_IDX; e = fat->runs[e].next)
+			n++;
+	else if (fss->allocMode == ALLOC_EXTENT)
+		for (size_t e = first; e != NIL_IDX; e = fat->runs[e].next)
+			n += fat->runs[e].len;
+	else
+		for (size_t b = first; b != NIL_IDX; b = fat->blocks[b].next)
+			n++;
+
+	if ((f->blockMap = malloc(n * sizeof(*f->blockMap))) == NULL) {
+		perror("malloc() in get_block_map()");
+		return NULL;
+	}
+
+	f->mapLen = 0;
+	if (fss->compMode != COMP_OFF)
+		for (size_t e = first; e != NIL_IDX; e = fat->runs[e].next)
+			f->blockMap[f->mapLen++] = e;
+	else if (fss->allocMode == ALLOC_EXTENT)
+		for (size_t e = first; e != NIL_IDX; e = fat->runs[e].next)
+			for (size_t j = 0; j < fat->runs[e].len; j++)
+				f->blockMap[f->mapLen++] = fat->runs[e].start + j;
+	else
+		for (size_t b = first; b != NIL_IDX; b = fat->blocks[b].next)
+			f->blockMap[f->mapLen++] = b;
+	f->mapCap = n;
+
+	return f->blockMap;
+}
+
+/**
+ * @brief returns the file's run index, walking its extent list to build it on
+ * first use; like the block map it sits alongside, it's kept in sync by
+ * write_shared() from then on
+ *
+ * @pre the file's block map has been built
+ *
+ * @return NULL if it couldn't be allocated
+ */
+uint32_t *get_run_index(size_t i, const fs_table *dt, const fs_table *fat) {
+	file_state *f = &dt->files[i];
+
+	if (f->runOf != NULL || f->mapCap == 0)
+		return f->runOf;
+
+	if ((f->runOf = malloc(f->mapCap * sizeof(*f->runOf))) == NULL) {
+		perror("malloc() in get_run_index()");
+		return NULL;
+	}
+
+	size_t k = 0;
+	for (size_t e = dt->dirs[i].firstBlockIdx; e != NIL_IDX;
+		 e		  = fat->runs[e].next)
+		for (size_t j = 0; j < fat->runs[e].len; j++)
+			f->runOf[k++] = e;
+
+	return f->runOf;
+}
+
+/**
+ * @brief makes room for at least `n` entries in the file's block map, and in
+ * its run index if it has one; an index that can't grow is dropped, to be
+ * built again when it's next needed
+ */
+_bool reserve_block_map(size_t i, size_t n, const fs_table *dt) {
+	file_state *f = &dt->files[i];
+
+	if (n <= f->mapCap)
+		return true;
+
+	size_t cap = MAX(n, f->mapCap * 2);
+	void *tmp  = realloc(f->blockMap, cap * sizeof(*f->blockMap));
+	if (tmp == NULL) {
+		perror("realloc() in reserve_block_map()");
+		return false;
+	}
+
+	f->blockMap = tmp;
+	f->mapCap	= cap;
+
+	if (f->runOf != NULL) {
+		if ((tmp = realloc(f->runOf, cap * sizeof(*f->runOf))) == NULL)
+			free(f->runOf);
+		f->runOf = tmp;
+	}
+
+	return true;
+}
+
+void drop_block_map(size_t i, const fs_table *dt) {
+	file_state *f = &dt->files[i];
+	readahead_drop(f);
+	free(f->blockMap);
+	free(f->runOf);
+	f->blockMap = NULL;
+	f->runOf	= NULL;
+	f->mapLen = f->mapCap = 0;
+}
+
+/**
+ * @brief links a freshly allocated run of blocks onto the end of the file: as
+ * one extent record in extent mode, or block by block through the FAT
+ *
+ * @pre the file's block map has room for the run
+ */
+static _bool link_run(size_t i, size_t start, size_t len,
+					  struct fs_settings *fss, const fs_table *dt,
+					  const fs_table *fat) {
+	file_state *f = &dt->files[i];
+
+	if (fss->allocMode == ALLOC_EXTENT &&
+		!append_run(&dt->dirs[i].firstBlockIdx, start, len, fss, fat))
+		return false;
+
+	md_mark_dir(i);
+
+	for (size_t b = start; b < start + len; b++) {
+		f->blockMap[f->mapLen++] = b;
+
+		if (fss->allocMode == ALLOC_EXTENT)
+			continue;
+
+		fat->blocks[b] = (fat_entry){.next = NIL_IDX};
+		md_mark_fat(b);
+
+		if (f->mapLen == 1) {
+			dt->dirs[i].firstBlockIdx = b;
+		} else {
+			fat->blocks[f->blockMap[f->mapLen - 2]].next = b;
+			md_mark_fat(f->blockMap[f->mapLen - 2]);
+		}
+	}
 
 	return true;
 }
 
+/**
+ * @brief makes sure the file has at least `nBlocks` blocks, taking as few
+ * free runs as possible from the free map, starting with the blocks right
+ * after the end of the file
+ *
+ * @pre the file's block map has been built
+ *
+ * @return 0 on success, negative on failure
+ */
+static int grow_file(size_t i, size_t nBlocks, struct fs_settings *fss,
+					 const fs_table *dt, const fs_table *fat) {
+	file_state *f = &dt->files[i];
+
+	if (nBlocks <= f->mapLen)
+		return 0;
+
+	if (nBlocks > fss->fMaxBlocks) {
+		fprintf(stderr, ERR_FILE_MAX_BLOCKS, fss->fMaxBlocks);
+		return -6;
+	}
+
+	if (nBlocks - f->mapLen > fss->freeBlocks) {
+		fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
+		return -7;
+	}
+
+	if (!reserve_block_map(i, nBlocks, dt))
+		return -8;
+
+	while (f->mapLen < nBlocks) {
+		size_t goal = f->mapLen > 0 ? f->blockMap[f->mapLen - 1] + 1 : SIZE_MAX;
+		size_t want = nBlocks - f->mapLen;
+		size_t got, start = alloc_run(goal, want, &got, fss, fat);
+
+		if (start == SIZE_MAX) {
+			fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
+			return -7;
+		}
+
+		if (!link_run(i, start, got, fss, dt, fat)) {
+			free_run(start, got, fss, fat);
+			return -8;
+		}
+	}
+
+	return 0;
+}
+
+/**
+ * @brief reads `size` bytes of a file from the disk, starting `fPos` bytes
+ * in, through its block map
+ *
+ * @return 0 on success, negative on failure
+ */
+static int read_span(const size_t *map, size_t mapLen, char *const retBuf,
+					 size_t size, size_t bs, size_t fPos) {
+	const size_t first = fPos / bs, last = (fPos + size - 1) / bs;
+	const size_t headOff = fPos % bs, tailLen = (fPos + size) % bs;
+
+	if (last >= mapLen) {
+		fprintf(stderr, "read_span(): unexpected EoF reached\n");
+		return -4;
+	}
+
+	/* only the first and last blocks can be partly covered by the read; just
+	 * those go through a bounce buffer */
+	const _bool headPart = headOff > 0 || (first == last && tailLen > 0);
+	const _bool tailPart = last > first && tailLen > 0;
+	char headBuf[bs], tailBuf[bs];
+	int ret = 0;
+
+	/* every run is queued before any is waited on */
+	aio_batch batch;
+	aio_batch_init(&batch, bs);
+
+	for (size_t k = first, n; k <= last; k += n) {
+		/* a run of physically adjacent blocks is read with one request,
+		 * scattered straight into the caller's buffer */
+		for (n = 1; k + n <= last && map[k + n] == map[k] + n;)
+			n++;
+
+		struct iovec iov[AIO_IOV];
+		int cnt = 0;
+		for (size_t j = k; j < k + n; j++) {
+			char *dst = j == first && headPart  ? headBuf
+						: j == last && tailPart ? tailBuf
+												: retBuf + (j * bs - fPos);
+
+			if (cnt > 0 &&
+				(char *)iov[cnt - 1].iov_base + iov[cnt - 1].iov_len == dst)
+				iov[cnt - 1].iov_len += bs;
+			else
+				iov[cnt++] = (struct iovec){.iov_base = dst, .iov_len = bs};
+		}
+
+		/* a lone, partly read block may well be cached */
+		if (n == 1 && (iov[0].iov_base == headBuf ||
+					   iov[0].iov_base == tailBuf)) {
+			if (read_block(map[k], bs, iov[0].iov_base) != 0) {
+				ret = -3;
+				break;
+			}
+		} else if (aio_readv(&batch, map[k], n, iov, cnt) != 0) {
+			break;
+		}
+	}
+
+	if (aio_wait(&batch) != 0 && ret == 0)
+		ret = -3;
+	aio_batch_destroy(&batch);
+
+	if (ret != 0)
+		return ret;
+
+	if (headPart)
+		memcpy(retBuf, headBuf + headOff, MIN(bs - headOff, size));
+	if (tailPart)
+		memcpy(retBuf + size - tailLen, tailBuf, tailLen);
+
+	return 0;
+}
+
 /**
  * @details read the contents of a file into a buffer, starting from a specified
  * index, and running till a specific length
@@ -83,57 +439,258 @@ int read_file_at(size_t i, char *const retBuf, size_t size,
 	if (i == SIZE_MAX || !dt->dirs[i].valid || dt->dirs[i].isDir)
 		return -1;
 
-	if (fPos + size > dt->dirs[i].size)
+	const size_t onDisk = dt->dirs[i].size;
+	if (fPos + size > file_size(i, dt))
 		return -2;
 
-	if (retBuf == NULL)
+	if (retBuf == NULL || size == 0)
 		return 0;
 
-	size_t bIdx = dt->dirs[i].firstBlockIdx;
+	/* appends yet to be written out are served from memory */
+	file_state *f	   = &dt->files[i];
+	const size_t asked = size;
+	if (fPos + size > onDisk) {
+		size_t from = MAX(fPos, onDisk);
+		memcpy(retBuf + (from - fPos), f->pend + (from - onDisk),
+			   fPos + size - from);
+		size = from - fPos;
+		if (size == 0)
+			return 0;
+	}
 
-	while (fPos > fss->blockSize) {
-		fPos -= fss->blockSize;
-		bIdx = fat->blocks[bIdx].next;
+	/* as is the content of a file kept inline */
+	if (entry_is_inline(&dt->dirs[i])) {
+		memcpy(retBuf, inline_data(dt, &dt->dirs[i]) + fPos, size);
+		return 0;
 	}
 
+	const size_t *map = get_block_map(i, fss, dt, fat);
+	if (map == NULL)
+		return -5;
+
+	if (fss->compMode != COMP_OFF)
+		return read_clusters(i, retBuf, size, fss, fPos, dt, fat);
+
+	/* and the blocks fetched ahead of a scan; the next ones are sent for
+	 * before whatever is left is read. The scan moves on by all the caller
+	 * got, appends included, so the read after this one carries it on */
+	const size_t bs = fss->blockSize;
+	const size_t done = readahead_serve(f, fPos, size, bs, retBuf);
+	readahead_advance(f, fPos, asked, bs);
+
+	if (done == size)
+		return 0;
+	return read_span(map, f->mapLen, retBuf + done, size - done, bs,
+					 fPos + done);
+}
+
+/**
+ * @brief writes a buf of data to a file's blocks, at the specified file index,
+ * ensuring the updation of all relevant metadata accordingly
+ *
+ * @details After setting up (i.e the block map, any blocks the file needs to
+ * grow by & its size), we loop until the entire buffer has been written to the
+ * file.
+ * 	1. Look up the block
+ * 	2. Read block, if it holds bytes of the file this write doesn't cover
+ * 	3. Update block
+ * 	4. Write back
+ * 	5. Update write index & remaining bytes
+ * Runs of whole, physically adjacent blocks skip steps 2-3 and are written
+ * straight from the caller's buffer in one go. Compressed files are written a
+ * cluster at a time instead, by write_clusters(), and files that may share
+ * blocks a block at a time, by write_shared().
+ *
+ * @param i file's index in the directory table
+ * @param size the size of the buffer
+ * @param fp the position of the file at which to start writing
+ *
+ * @return 0 on success, negative on failure
+ */
+static int write_span(size_t i, const char *buf, size_t size,
+					  struct fs_settings *fss, size_t fPos, const fs_table *dt,
+					  const fs_table *fat) {
+	if (fss->compMode != COMP_OFF)
+		return write_clusters(i, buf, size, fss, fPos, dt, fat);
+	if (fss->shareMode != SHARE_OFF)
+		return write_shared(i, buf, size, fss, fPos, dt, fat);
+
+	if (get_block_map(i, fss, dt, fat) == NULL &&
+		dt->dirs[i].firstBlockIdx != NIL_IDX)
+		return -8;
+
+	/* allocate every block the write will need up front, so that in extent
+	 * mode they can be taken as a few contiguous runs */
+	int ret;
+	size_t end = fPos + size, oldSize = dt->dirs[i].size;
+	if ((ret = grow_file(i, (end + fss->blockSize - 1) / fss->blockSize, fss,
+						 dt, fat)) < 0)
+		return ret;
+
+	if (end > dt->dirs[i].size) {
+		dt->dirs[i].size = end;
+		md_mark_dir(i);
+	}
+
+	const size_t *map = dt->files[i].blockMap, mapLen = dt->files[i].mapLen;
+	size_t k		  = fPos / fss->blockSize;
+	fPos %= fss->blockSize;
+
 	char dataBuf[fss->blockSize];
-	size_t written = 0;
+
+	/* runs of whole blocks are all queued, then waited on once at the end */
+	aio_batch batch;
+	aio_batch_init(&batch, fss->blockSize);
 
 	while (size > 0) {
-		if (read_block(bIdx, fss->blockSize, dataBuf) != 0)
-			return -3;
+		size_t bStart = k * fss->blockSize;
+		size_t bIdx	  = map[k++];
+
+		/* whole blocks are overwritten entirely, so there's nothing to read */
+		if (fPos == 0 && size >= fss->blockSize) {
+			size_t n = 1;
+			while (n < size / fss->blockSize && k < mapLen &&
+				   map[k] == bIdx + n) {
+				k++;
+				n++;
+			}
+
+			if (aio_write(&batch, bIdx, n, buf) != 0) {
+				ret = -5;
+				break;
+			}
+
+			size -= n * fss->blockSize;
+			buf += n * fss->blockSize;
+			continue;
+		}
 
 		int bytesCopied = MIN(fss->blockSize - fPos, size);
-		memcpy(retBuf + written, dataBuf + fPos, bytesCopied);
+
+		/* in mmap mode, copy straight into the mapping */
+		char *dst = block_ptr(bIdx, fss->blockSize);
+		if (dst != NULL) {
+			memcpy(dst + fPos, buf, bytesCopied);
+		} else {
+			/* only bytes of the file the write leaves alone need reading; a
+			 * block past the old end of the file, e.g one that was just
+			 * allocated, has none */
+			size_t live = MIN(bStart + fss->blockSize, oldSize);
+			if (fPos > 0 || bStart + bytesCopied < live) {
+				if (read_block(bIdx, fss->blockSize, dataBuf) != 0) {
+					ret = -4;
+					break;
+				}
+			} else {
+				memset(dataBuf, 0, fss->blockSize);
+			}
+
+			memcpy(dataBuf + fPos, buf, bytesCopied);
+
+			if (write_block(bIdx, fss->blockSize, dataBuf) != 0) {
+				ret = -5;
+				break;
+			}
+		}
 
 		fPos = 0;
 		size -= bytesCopied;
-		written += bytesCopied;
+		buf += bytesCopied;
+	}
 
-		if (size > 0) {
-			bIdx = fat->blocks[bIdx].next;
-			if (bIdx == SIZE_MAX) {
-				fprintf(stderr, "read_file_at(): unexpected EoF reached\n");
-				return -4;
-			}
+	/* the data must be down before the journal commits the metadata */
+	if (aio_wait(&batch) != 0 && ret == 0)
+		ret = -5;
+	aio_batch_destroy(&batch);
+
+	return ret;
+}
+
+/**
+ * @return the most bytes of content file `i` can keep inline, next to its
+ * name; 0 in images from before format version 4
+ */
+static size_t inline_room(size_t i, const struct fs_settings *fss,
+						  const fs_table *dt) {
+	return fss->version < 4 ? 0 : MAX_NAME_LEN - dt->dirs[i].nameLen;
+}
+
+/**
+ * @brief hands every block of a file back, leaving it with none; its size is
+ * left to the caller
+ */
+static void release_blocks(size_t i, const fs_table *dt, const fs_table *fat,
+						   struct fs_settings *const fss) {
+	if (fss->allocMode == ALLOC_EXTENT) {
+		release_extent_list(dt->dirs[i].firstBlockIdx, fss, fat);
+		goto reset;
+	}
+
+	/* traverse the file's chain, handing back physically adjacent blocks to
+	 * the free map a run at a time */
+	size_t runStart = SIZE_MAX, runLen = 0;
+	for (size_t b = dt->dirs[i].firstBlockIdx, next; b != NIL_IDX; b = next) {
+		next		   = fat->blocks[b].next;
+		fat->blocks[b] = (fat_entry){.next = NIL_IDX};
+		md_mark_fat(b);
+
+		if (runLen > 0 && runStart + runLen == b) {
+			runLen++;
+			continue;
 		}
+
+		if (runLen > 0)
+			free_run(runStart, runLen, fss, fat);
+		runStart = b;
+		runLen	 = 1;
 	}
 
-	return 0;
+	if (runLen > 0)
+		free_run(runStart, runLen, fss, fat);
+
+reset:
+	dt->dirs[i].firstBlockIdx = NIL_IDX;
+	md_mark_dir(i);
+	drop_block_map(i, dt);
 }
 
 /**
- * @brief writes a buf of data to a file, at the specified file index, ensuring
- * the updation of all relevant metadata accordingly
+ * @brief moves the content of a file kept inline out to blocks of its own.
+ * The content stays where it is until they've all been written; if that
+ * fails, whatever blocks were linked are let go again, and the file is left
+ * as it was.
  *
- * @details After validation and setting up (i.e variables & firstBlockIdx if
- * need be), we loop until the entire buffer has been written to the file.
- * 	1. Read block
- * 	2. Update block
- * 	3. Write back
- * 	4. Update size/usage
- * 	5. Update write index & remaining bytes
- * 	6. Update block chain & possibly freeListPtr
+ * @return 0 on success, negative on failure
+ */
+static int move_out(size_t i, struct fs_settings *fss, const fs_table *dt,
+					const fs_table *fat) {
+	dir_entry *e = &dt->dirs[i];
+	if (!entry_is_inline(e) || e->size == 0)
+		return 0;
+
+	char data[MAX_NAME_LEN];
+	const size_t n = e->size;
+	memcpy(data, inline_data(dt, e), n);
+
+	/* a paged heap's length is taken from the spans in it, so is pinned down
+	 * while this one still covers the content */
+	settle_name_heap(dt);
+
+	int ret = write_span(i, data, n, fss, 0, dt, fat);
+	if (ret < 0) {
+		release_blocks(i, dt, fat, fss);
+		e->size = n;
+		return ret;
+	}
+
+	drop_inline(i, n, dt);
+	return 0;
+}
+
+/**
+ * @brief writes a buf of data to a file at `fPos`. A file small enough is
+ * kept inline, in its name's span of the name heap, and only moves to blocks
+ * once it outgrows that.
  *
  * @param i file's index in the directory table
  * @param size the size of the buffer
@@ -141,87 +698,163 @@ int read_file_at(size_t i, char *const retBuf, size_t size,
  *
  * @return 0 on success, negative on failure
  */
-int write_to_file(size_t i, const char *buf, size_t size,
-				  struct fs_settings *fss, size_t fPos, const fs_table *dt,
-				  const fs_table *fat) {
+static int write_at(size_t i, const char *buf, size_t size,
+					struct fs_settings *fss, size_t fPos, const fs_table *dt,
+					const fs_table *fat) {
 	if (i == SIZE_MAX || !dt->dirs[i].valid || dt->dirs[i].isDir)
 		return -1;
 
-	if (fPos > dt->dirs[i].size)
+	dir_entry *e = &dt->dirs[i];
+	if (fPos > e->size)
 		return -2;
 
+	/* whatever was fetched ahead of a scan may be about to go stale */
+	readahead_drop(&dt->files[i]);
+
 	if (buf == NULL || size == 0)
 		return 0;
 
-	size_t bIdx = dt->dirs[i].firstBlockIdx;
-
-	while (fPos > fss->blockSize) {
-		fPos -= fss->blockSize;
-		bIdx = fat->blocks[bIdx].next;
-	}
-
-	if (bIdx == SIZE_MAX) { /* file is empty */
-		if (fss->freeListPtr == SIZE_MAX) {
-			fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
-			return -3;
+	if (entry_is_inline(e)) {
+		const size_t end = MAX(e->size, fPos + size);
+		if (end <= inline_room(i, fss, dt)) {
+			char data[MAX_NAME_LEN];
+			memcpy(data, inline_data(dt, e), e->size);
+			memcpy(data + fPos, buf, size);
+			return store_inline(i, data, end, dt) ? 0 : -8;
 		}
 
-		bIdx = dt->dirs[i].firstBlockIdx = fss->freeListPtr;
-		increment_free_list_ptr(fss, fat);
-		fat->blocks[bIdx].next = SIZE_MAX;
+		int ret = move_out(i, fss, dt, fat);
+		if (ret < 0)
+			return ret;
 	}
 
-	char dataBuf[fss->blockSize];
+	return write_span(i, buf, size, fss, fPos, dt, fat);
+}
 
-	while (size > 0) {
-		if (read_block(bIdx, fss->blockSize, dataBuf) != 0)
-			return -4;
+/**
+ * @brief write_at() as one journalled operation; blocks allocated by a write
+ * that fails midway are logged too, as they belong to the file by then
+ */
+static int write_op(size_t i, const char *buf, size_t size,
+					struct fs_settings *fss, size_t fPos, const fs_table *dt,
+					const fs_table *fat) {
+	md_begin_op();
+	int ret = write_at(i, buf, size, fss, fPos, dt, fat);
+	md_end_op();
+	return ret;
+}
 
-		int bytesCopied = MIN(fss->blockSize - fPos, size);
-		memcpy(dataBuf + fPos, buf, bytesCopied);
+/**
+ * @return the size of a file, counting the appends held in memory
+ */
+size_t file_size(size_t i, const fs_table *dt) {
+	return dt->dirs[i].size + dt->files[i].pendLen;
+}
 
-		if (write_block(bIdx, fss->blockSize, dataBuf) != 0)
-			return -5;
+/**
+ * @brief writes the appends held in memory for a file to its blocks
+ *
+ * @return 0 on success, negative on failure, in which case whatever couldn't
+ * be written stays held
+ */
+int flush_file(size_t i, struct fs_settings *fss, const fs_table *dt,
+			   const fs_table *fat) {
+	if (i == SIZE_MAX || i >= dt->size || dt->files[i].pendLen == 0)
+		return 0;
 
-		size_t newUsage = fPos + bytesCopied;
-		if (newUsage > fat->blocks[bIdx].used) {
-			dt->dirs[i].size += (newUsage - fat->blocks[bIdx].used);
-			fat->blocks[bIdx].used = newUsage;
-		}
+	file_state *f	  = &dt->files[i];
+	const size_t from = dt->dirs[i].size;
+	int ret = write_op(i, f->pend, f->pendLen, fss, from, dt, fat);
 
-		fPos = 0;
-		size -= bytesCopied;
-		buf += bytesCopied;
+	/* a failed write may still have got some of it out */
+	size_t done = MIN(dt->dirs[i].size - from, f->pendLen);
+	memmove(f->pend, f->pend + done, f->pendLen - done);
+	f->pendLen -= done;
+	return ret;
+}
 
-		if (size > 0) {
-			if (fat->blocks[bIdx].next != SIZE_MAX) {
-				bIdx = fat->blocks[bIdx].next;
-				continue;
-			}
+/**
+ * @brief writes a buf of data to a file at `fPos`, after the appends still
+ * held in memory for it
+ */
+int write_to_file(size_t i, const char *buf, size_t size,
+				  struct fs_settings *fss, size_t fPos, const fs_table *dt,
+				  const fs_table *fat) {
+	int ret = flush_file(i, fss, dt, fat);
+	return ret < 0 ? ret : write_op(i, buf, size, fss, fPos, dt, fat);
+}
 
-			if (dt->dirs[bIdx].size / fss->blockSize > fss->fMaxBlocks) {
-				fprintf(stderr, ERR_FILE_MAX_BLOCKS, fss->fMaxBlocks);
-				return -6;
-			}
+/**
+ * @return the number of bytes appends are held back to: a block, or in a
+ * compressed filesystem a cluster, each write of which stores all of it again
+ */
+static size_t hold_unit(const struct fs_settings *fss) {
+	return fss->compMode != COMP_OFF ? ZCLUSTER_BLOCKS * fss->blockSize
+									 : fss->blockSize;
+}
 
-			if (fss->freeListPtr == SIZE_MAX) {
-				fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
-				return -7;
-			}
+/**
+ * @brief holds `size` bytes of appends in memory, behind the ones already held
+ *
+ * @pre they don't complete a hold_unit()
+ */
+static int hold(size_t i, const char *buf, size_t size,
+				const struct fs_settings *fss, const fs_table *dt) {
+	file_state *f = &dt->files[i];
+	if (size == 0)
+		return 0;
 
-			bIdx = fat->blocks[bIdx].next = fss->freeListPtr;
-			increment_free_list_ptr(fss, fat);
-			fat->blocks[bIdx].next = SIZE_MAX;
-		}
+	if (f->pend == NULL && (f->pend = malloc(hold_unit(fss))) == NULL) {
+		perror("malloc() in hold()");
+		return -8;
 	}
 
+	memcpy(f->pend + f->pendLen, buf, size);
+	f->pendLen += size;
 	return 0;
 }
 
+/**
+ * @brief appends a buf of data to a file. Nothing is written, or allocated,
+ * until a hold_unit()'s worth of data is ready; until then, the bytes are
+ * held in memory and served from there, and go out on flush_file(), on a
+ * write elsewhere in the file, or on a checkpoint.
+ */
 int append_to_file(size_t i, const char *buf, size_t size,
 				   struct fs_settings *fss, const fs_table *dt,
 				   const fs_table *fat) {
-	return write_to_file(i, buf, size, fss, dt->dirs[i].size, dt, fat);
+	if (i == SIZE_MAX || !dt->dirs[i].valid || dt->dirs[i].isDir)
+		return -1;
+
+	if (buf == NULL || size == 0)
+		return 0;
+
+	file_state *f	  = &dt->files[i];
+	const size_t unit = hold_unit(fss);
+	int ret;
+
+	/* bytes left to fill the unit the held ones end in */
+	size_t fill = unit - (dt->dirs[i].size + f->pendLen) % unit;
+	if (size < fill)
+		return hold(i, buf, size, fss, dt);
+
+	/* the held bytes go out along with the ones completing their unit */
+	if (f->pendLen > 0) {
+		memcpy(f->pend + f->pendLen, buf, fill);
+		f->pendLen += fill;
+		buf += fill;
+		size -= fill;
+		if ((ret = flush_file(i, fss, dt, fat)) < 0)
+			return ret;
+	}
+
+	/* anything up to the last unit boundary skips the buffer */
+	const size_t pos = dt->dirs[i].size, direct = size - (pos + size) % unit;
+	if (direct > 0 &&
+		(ret = write_op(i, buf, direct, fss, pos, dt, fat)) < 0)
+		return ret;
+
+	return hold(i, buf + direct, size - direct, fss, dt);
 }
 
 /**
@@ -235,32 +868,22 @@ dir_entry **get_directory_entries(size_t i, const fs_table *const dt,
 	if (i == SIZE_MAX || !dt->dirs[i].valid || !dt->dirs[i].isDir)
 		return NULL;
 
-	*n				= 0;
-	size_t numDirs	= 8;
-	dir_entry **ret = malloc(numDirs * sizeof(*ret));
+	*n = 0;
+	for (size_t j = dt->dirs[i].firstChild; j != NIL_IDX;
+		 j		  = dt->dirs[j].nextSibling)
+		(*n)++;
 
+	dir_entry **ret = malloc((*n + 1) * sizeof(*ret));
 	if (ret == NULL) {
 		perror("malloc() in get_directory_contents()");
 		return NULL;
 	}
 
 	/* generate list */
-	for (size_t j = 1; j < dt->size; j++) {
-		if (dt->dirs[j].valid && dt->dirs[j].parentIdx == i) {
-			ret[(*n)++] = &dt->dirs[j];
-
-			if (*n >= numDirs) {
-				numDirs *= 2;
-				void *tmp = realloc(ret, numDirs);
-				if (tmp == NULL) {
-					perror("realloc() in get_directory_contents()");
-					free(ret);
-					return NULL;
-				}
-				ret = tmp;
-			}
-		}
-	}
+	size_t k = 0;
+	for (size_t j = dt->dirs[i].firstChild; j != NIL_IDX;
+		 j		  = dt->dirs[j].nextSibling)
+		ret[k++] = &dt->dirs[j];
 
 	ret[*n] = NULL;
 
@@ -276,7 +899,8 @@ void print_directory_contents(size_t i, const fs_table *const dt) {
 		return;
 
 	for (size_t i = 0; e[i] != NULL; i++)
-		printf("%s%s%s\n", e[i]->isDir ? BOLD_BLUE : CYAN, e[i]->name, RESET);
+		printf("%s%s%s\n", e[i]->isDir ? BOLD_BLUE : CYAN, entry_name(dt, e[i]),
+			   RESET);
 
 	free(e);
 }
@@ -285,145 +909,296 @@ void print_directory_contents(size_t i, const fs_table *const dt) {
  * @brief remove the entire contents of a file, i.e make them 'available' for
  * other files' writes.
  *
- * @pre if a file is empty, it's 'firstBlockIdx' is SIZE_MAX.
- * @pre the final block of a file's content chain has it's 'next' set to
- * SIZE_MAX.
+ * @pre if a file has no blocks, it's 'firstBlockIdx' is NIL_IDX.
+ * @pre the final block of a file's content chain (or the final record of its
+ * extent list) has it's 'next' set to NIL_IDX.
  */
 _bool truncate_file(size_t i, fs_table *dt, fs_table *fat,
 				   struct fs_settings *const fss) {
 	if (i == SIZE_MAX || !dt->dirs[i].valid || dt->dirs[i].isDir)
 		return false;
 
-	if (dt->dirs[i].size == 0)
+	/* held appends never got blocks, nor did inline content */
+	dt->files[i].pendLen = 0;
+	if (entry_is_inline(&dt->dirs[i])) {
+		if (dt->dirs[i].size > 0) {
+			md_begin_op();
+			store_inline(i, NULL, 0, dt);
+			md_end_op();
+		}
 		return true;
-
-	size_t bIdx = dt->dirs[i].firstBlockIdx;
-	size_t prev = bIdx;
-
-	/* traverse the file's chain until we reach the final block */
-	while (bIdx != SIZE_MAX) {
-		fat->blocks[bIdx].used = 0;
-		prev				   = bIdx;
-		bIdx				   = fat->blocks[bIdx].next;
 	}
-	bIdx = prev;
-
-	/* Point the end of this file's chain towards the free list */
-	fat->blocks[bIdx].next = fss->freeListPtr;
 
-	/* Set the start of this (now empty) chain as the free list */
-	fss->freeListPtr = dt->dirs[i].firstBlockIdx;
-
-	dt->dirs[i].firstBlockIdx = SIZE_MAX;
-	dt->dirs[i].size		  = 0;
+	md_begin_op();
+	release_blocks(i, dt, fat, fss);
+	dt->dirs[i].size = 0;
+	md_end_op();
 	return true;
 }
-
 /**
- * @brief Delete a file or recursively, the contents of a directory. The
- * 'name' is freed.
+ * @brief Delete a file or recursively, the contents of a directory
  */
 _bool remove_dir_entry(size_t i, fs_table *dt, fs_table *fat,
 					  struct fs_settings *const fss) {
 	if (i == SIZE_MAX || i == ROOT_IDX || !dt->dirs[i].valid)
 		return false;
 
-	if (!dt->dirs[i].isDir) {
+	/* a directory's removal, children and all, is committed in one go */
+	md_begin_op();
+	if (!dt->dirs[i].isDir)
 		truncate_file(i, dt, fat, fss);
-	} else {
-		for (size_t j = 0; j < dt->size; j++)
-			if (dt->dirs[j].valid && dt->dirs[j].parentIdx == i)
-				remove_dir_entry(j, dt, fat, fss);
-	}
+	else
+		while (dt->dirs[i].firstChild != NIL_IDX)
+			remove_dir_entry(dt->dirs[i].firstChild, dt, fat, fss);
 
-	free(dt->dirs[i].name);
+	unlink_child(i, dt);
+	dir_index_remove(i, dt);
+	drop_name(i, dt);
 	dt->dirs[i] = DIR_TABLE_GARBAGE_ENTRY;
+	md_mark_dir(i);
+	md_end_op();
 	return true;
 }
 
 /**
- * @brief renames an entry in the global directory table. The old 'name' is
- * freed. On failure, the user should free newName
+ * @brief renames an entry in the global directory table. `newName` is copied
+ * into the name heap; inline content that no longer fits alongside it moves
+ * to blocks.
  */
-_bool rename_dir_entry(char *newName, size_t i, fs_table *dt) {
-	if (i == SIZE_MAX || !dt->dirs[i].valid)
+_bool rename_dir_entry(const char *newName, size_t i, fs_table *dt,
+					   fs_table *fat, struct fs_settings *const fss) {
+	const size_t nameLen = strlen(newName);
+	if (i == SIZE_MAX || !dt->dirs[i].valid || nameLen > MAX_NAME_LEN)
 		return false;
 
 	/* if an entry w/ that name already exists */
 	if (get_index_of_dir_entry(newName, dt->dirs[i].parentIdx, dt) != SIZE_MAX)
 		return false;
 
-	free(dt->dirs[i].name);
-	dt->dirs[i].name	= newName;
-	dt->dirs[i].nameLen = strlen(newName);
+	md_begin_op();
+	if (entry_is_inline(&dt->dirs[i]) &&
+		nameLen + dt->dirs[i].size > MAX_NAME_LEN &&
+		move_out(i, fss, dt, fat) < 0) {
+		md_end_op();
+		return false;
+	}
+
+	dir_index_remove(i, dt);
+	_bool ret = store_name(i, newName, nameLen, dt);
+	dir_index_insert(i, dt);
+	md_end_op();
+
+	return ret;
+}
+
+/**
+ * @brief gives the clone `j` of file `src` references to each of its runs of
+ * blocks, through extent records of its own
+ *
+ * @return false if the extent table hasn't got enough spare records
+ */
+static _bool share_runs(size_t src, size_t j, struct fs_settings *fss,
+						const fs_table *dt, const fs_table *fat) {
+	const extent *r = fat->runs;
+	size_t n		= 0;
+
+	for (size_t e = dt->dirs[src].firstBlockIdx; e != NIL_IDX; e = r[e].next)
+		n++;
+
+	if (!has_spare_records(n, fss, fat)) {
+		fprintf(stderr, "clone_file(): extent table exhausted\n");
+		return false;
+	}
+
+	size_t last = NIL_IDX;
+	for (size_t e = dt->dirs[src].firstBlockIdx; e != NIL_IDX; e = r[e].next) {
+		last = insert_run(&dt->dirs[j].firstBlockIdx, last, r[e].start,
+						  r[e].len, fss, fat);
+		share_run(r[e].start, r[e].len, fat);
+	}
 
+	dt->dirs[j].size = dt->dirs[src].size;
+	md_mark_dir(j);
 	return true;
 }
 
 /**
- * @brief writes all metadata to a buffer and then the filesystem
+ * @brief copies file `src`'s content into the empty file `j`, by reading it
+ * and writing it out again
+ *
+ * @return 0 on success, negative on failure
  */
-_bool serialise_metadata(const struct fs_settings *fss, const fs_table *const dt,
-						const fs_table *const fat) {
-	size_t size = 0;
-	char buf[fss->numMdBlocks * fss->blockSize];
-	memset(buf, 0, sizeof(buf));
+static int copy_content(size_t src, size_t j, struct fs_settings *fss,
+						const fs_table *dt, const fs_table *fat) {
+	const size_t size = dt->dirs[src].size;
+	if (size == 0)
+		return 0;
+
+	const size_t unit = MIN(size, MAX(fss->blockSize, CLONE_CHUNK));
+	char *buf		  = malloc(unit);
+	if (buf == NULL) {
+		perror("malloc() in copy_content()");
+		return -8;
+	}
+
+	int ret = 0;
+	for (size_t pos = 0, n; ret == 0 && pos < size; pos += n) {
+		n	= MIN(unit, size - pos);
+		ret = read_file_at(src, buf, n, fss, pos, dt, fat);
+		if (ret == 0)
+			ret = write_at(j, buf, n, fss, pos, dt, fat);
+	}
+
+	free(buf);
+	return ret;
+}
+
+/**
+ * @brief creates a file named `name` under the directory at `cwd` index, with
+ * the same content as file `src`. Where files share blocks, the copy only
+ * takes references to the source's blocks, so no data is read or written;
+ * either file gets blocks of its own as it changes them (see dedup.c).
+ * Elsewhere, the content is copied over.
+ */
+_bool clone_file(size_t src, const char *name, size_t cwd,
+				 struct fs_settings *fss, fs_table *dt, fs_table *fat) {
+	if (src == SIZE_MAX || !dt->dirs[src].valid || dt->dirs[src].isDir)
+		return false;
+
+	/* the copy is made from what's on disk, held appends included */
+	if (flush_file(src, fss, dt, fat) < 0)
+		return false;
+
+	md_begin_op();
+	if (!create_dir_entry(name, cwd, false, dt)) {
+		md_end_op();
+		return false;
+	}
+
+	size_t j  = get_index_of_dir_entry(name, cwd, dt);
+	_bool ret = fss->shareMode != SHARE_OFF && !entry_is_inline(&dt->dirs[src])
+					? share_runs(src, j, fss, dt, fat)
+					: copy_content(src, j, fss, dt, fat) == 0;
 
-	/* filesystem settings */
-	memcpy(buf + size, fss, sizeof(struct fs_settings));
-	size += sizeof(struct fs_settings);
+	if (!ret)
+		remove_dir_entry(j, dt, fat, fss);
+	md_end_op();
+	return ret;
+}
 
-	/* directory table */
+/**
+ * @brief checkpoints: writes the metadata blocks that changed since the last
+ * call to the filesystem and starts the journal over
+ */
+_bool serialise_metadata(struct fs_settings *fss, const fs_table *const dt,
+						const fs_table *const fat) {
+	/* appends held in memory are written out first */
+	_bool ret = true;
 	for (size_t i = 0; i < dt->size; i++)
-		write_dir_entry_to_buf(&dt->dirs[i], buf, &size);
+		if (dt->files[i].pendLen > 0 && flush_file(i, fss, dt, fat) < 0)
+			ret = false;
 
-	/* file allocation table */
-	memcpy(buf + size, fat->blocks, sizeof(fat_entry) * fat->size);
-	size += sizeof(fat_entry) * fat->size;
+	return md_checkpoint(fss, dt, fat) == 0 && ret;
+}
 
-	/* serialisation */
-	for (size_t i = 0; i < fss->numMdBlocks; size -= fss->blockSize, i++)
-		if (write_block(i, fss->blockSize, buf + (i * fss->blockSize)) < 0)
-			return false;
+/**
+ * @brief frees the in-memory tables wholesale, along with the files' block
+ * maps; nothing is written back
+ */
+void free_tables(fs_table *dt, fs_table *fat) {
+	for (size_t i = 0; dt->files != NULL && i < dt->size; i++) {
+		readahead_drop(&dt->files[i]);
+		free(dt->files[i].blockMap);
+		free(dt->files[i].runOf);
+		free(dt->files[i].pend);
+	}
 
-	return true;
+	free_dir_index(dt);
+	free_name_heap(dt);
+	dedup_reset();
+	free(dt->files);
+	if (!dt->mapped)
+		free(dt->dirs);
+	if (!fat->mapped) {
+		free(fat->blocks);
+		free(fat->freeMap);
+		free(fat->refs);
+	}
+
+	dt->files	 = NULL;
+	dt->dirs	 = NULL;
+	fat->blocks	 = NULL;
+	fat->freeMap = NULL;
+	fat->refs	 = NULL;
+}
+
+/**
+ * @brief turns off the modes an image is too old to have; it may hold
+ * anything in the padding they took the place of
+ */
+static void settle_modes(struct fs_settings *const fss) {
+	if (fss->version < 5)
+		fss->compMode = COMP_OFF;
+	if (fss->version < 6)
+		fss->shareMode = SHARE_OFF;
 }
 
 /**
- * @brief reads a buf at the i'th index to obtain a directory table entry,
- * allocating space for names
+ * @brief fills in the settings and both tables from the home metadata region
+ * in `buf`, either copying them out of it or, if `inPlace`, using them where
+ * they lie
  */
-_bool obtain_dir_entry_from_buf(dir_entry *const e, const char *const b,
-							   size_t *const i) {
-	memcpy(&e->valid, b + *i, sizeof(e->valid));
-	*i += sizeof(e->valid);
-	memcpy(&e->isDir, b + *i, sizeof(e->isDir));
-	*i += sizeof(e->isDir);
-	memcpy(&e->nameLen, b + *i, sizeof(e->nameLen));
-	*i += sizeof(e->nameLen);
+static _bool load_tables(struct fs_settings *const fss, fs_table *const dt,
+						 fs_table *const fat, char *buf, _bool inPlace) {
+	memcpy(fss, buf, sizeof(struct fs_settings));
+	settle_modes(fss);
 
-	if (e->nameLen == 0) {
-		e->name = "";
-	} else if (e->nameLen == 1 && b[*i] == '/') {
-		e->name = "/";
+	dt->size	= fss->entryCount;
+	fat->size	= fss->numBlocks;
+	dt->mapped	= inPlace;
+	fat->mapped = inPlace;
+
+	const size_t dirBytes = sizeof(dt->dirs[0]) * dt->size,
+				 fatBytes = fat_entry_size(fss) * fat->size,
+				 mapBytes = bitmap_words(fat->size) * sizeof(uint64_t),
+				 refBytes = sizeof(block_ref) * fat->size;
+	const _bool shared = fss->shareMode != SHARE_OFF;
+
+	dt->files = calloc(dt->size, sizeof(dt->files[0]));
+	if (inPlace) {
+		dt->dirs	 = (dir_entry *)(buf + md_dir_offset(0));
+		fat->blocks	 = (void *)(buf + md_fat_offset());
+		fat->freeMap = (uint64_t *)(buf + md_map_offset());
+		fat->refs = shared ? (block_ref *)(buf + md_refs_offset()) : NULL;
 	} else {
-		e->name = malloc(e->nameLen + 1);
-		if (e->name == NULL) {
-			perror("malloc() in obtain_dir_entry_from_buf()");
-			return false;
-		}
-		memcpy(e->name, b + *i, e->nameLen);
-		e->name[e->nameLen] = '\0';
+		dt->dirs	 = malloc(dirBytes);
+		fat->blocks	 = malloc(fatBytes);
+		fat->freeMap = malloc(mapBytes);
+		fat->refs	 = shared ? malloc(refBytes) : NULL;
+	}
+
+	if (dt->files == NULL || dt->dirs == NULL || fat->blocks == NULL ||
+		fat->freeMap == NULL || (shared && fat->refs == NULL)) {
+		perror("malloc() in load_tables()");
+		free_tables(dt, fat);
+		return false;
 	}
 
-	*i += e->nameLen;
-	memcpy(&e->size, b + *i, sizeof(e->size));
-	*i += sizeof(e->size);
-	memcpy(&e->parentIdx, b + *i, sizeof(e->parentIdx));
-	*i += sizeof(e->parentIdx);
-	memcpy(&e->firstBlockIdx, b + *i, sizeof(e->firstBlockIdx));
-	*i += sizeof(e->firstBlockIdx);
+	if (!inPlace) {
+		md_unpack(buf, dt, fat);
+		memcpy(fat->freeMap, buf + md_map_offset(), mapBytes);
+		if (shared)
+			memcpy(fat->refs, buf + md_refs_offset(), refBytes);
+	}
+
+	if (!init_name_heap(dt, buf + md_names_offset())) {
+		free_tables(dt, fat);
+		return false;
+	}
 
+	/* lookups fall back to a linear scan without it. Paged tables only have
+	 * it filled in on first use, so mounting doesn't read every entry. */
+	build_dir_index(dt, inPlace);
 	return true;
 }
 
@@ -434,90 +1209,91 @@ _bool deserialise_metadata(struct fs_settings *const fss, fs_table *const dt,
 						  fs_table *const fat) {
 
 	/* obtain settings */
-	size_t size = sizeof(struct fs_settings);
 	char tmp[BLOCK_SIZE];
 
 	if (read_block(0, BLOCK_SIZE, tmp) < 0)
 		return false;
 
-	memcpy(fss, tmp, size);
+	memcpy(fss, tmp, sizeof(struct fs_settings));
+	settle_modes(fss);
 
-	char buf[fss->numMdBlocks * fss->blockSize];
-	memset(buf, 0, sizeof(buf));
-
-	/* deserialise */
-	for (size_t i = 0; i < fss->numMdBlocks; i++)
-		if (read_block(i, fss->blockSize, buf + (i * fss->blockSize)) < 0)
-			return false;
-
-	/* directory table */
-	dt->size = fss->entryCount;
-	dt->dirs = malloc(sizeof(dt->dirs[0]) * dt->size);
-
-	if (dt->dirs == NULL) {
-		perror("malloc() in deserialise_metadata() - dt->dirs");
+	if (fss->magic != FS_MAGIC || fss->version < 1 ||
+		fss->version > FS_VERSION) {
+		fprintf(stderr,
+				"deserialise_metadata(): %s isn't an image of format version "
+				"1 to %d\n",
+				FS_NAME, FS_VERSION);
 		return false;
 	}
 
-	for (size_t i = 0; i < dt->size; i++)
-		if (!obtain_dir_entry_from_buf(&dt->dirs[i], buf, &size))
-			return false;
+	/* images from before the name heap was sized correctly may not hold it,
+	 * and older formats may have more blocks than 32-bit links reach */
+	if (md_size(fss) > (fss->numMdBlocks - fss->jnlBlocks) * fss->blockSize ||
+		fss->numBlocks >= NIL_IDX) {
+		fprintf(stderr,
+				"deserialise_metadata(): %s's metadata can't be loaded\n",
+				FS_NAME);
+		return false;
+	}
 
-	/* file allocation table */
-	fat->size	= fss->numBlocks;
-	fat->blocks = malloc(fat->size * sizeof(fat->blocks[0]));
+	if (!md_init(fss, dt, fat, false) || !journal_init(fss))
+		return false;
 
-	if (fat->blocks == NULL) {
-		free(dt->dirs);
-		perror("malloc() in deserialise_metadata() - fat->blocks");
+	/* the whole home region, mapped if it's to be paged in, and read in
+	 * otherwise; far too big for the stack on large images */
+	const size_t homeBlocks = fss->numMdBlocks - fss->jnlBlocks;
+	const size_t len		= homeBlocks * fss->blockSize;
+	char *map				= md_map();
+	char *buf				= map != NULL ? map : calloc(len, 1);
+	if (buf == NULL) {
+		perror("calloc() in deserialise_metadata()");
 		return false;
 	}
 
-	memcpy(fat->blocks, buf + size, sizeof(fat->blocks[0]) * fat->size);
-
-	return true;
-}
+	/* deserialise */
+	_bool ret = true;
+	for (size_t i = 0; ret && map == NULL && i < homeBlocks; i++)
+		ret = read_block(i, fss->blockSize, buf + (i * fss->blockSize)) >= 0;
+
+	/* bring the image up to date with what was committed since the last
+	 * checkpoint, settings included */
+	long replayed = ret ? journal_replay(buf, len) : -1;
+	ret = replayed >= 0 && load_tables(fss, dt, fat, buf, map != NULL);
+	if (map == NULL)
+		free(buf);
+
+	/* fold the journal back into the home locations so it can start over */
+	if (ret && replayed > 0) {
+		md_mark_all();
+		ret = md_checkpoint(fss, dt, fat) == 0;
+	}
 
-/**
- * @details writes a directory table entry to a buffer's i'th index. The
- * index is incremented accordingly.
- *
- * @pre the buffer is large enough to hold the entry
- */
-void write_dir_entry_to_buf(const dir_entry *const e, char *const b,
-							size_t *i) {
-	memcpy(b + *i, &e->valid, sizeof(e->valid));
-	*i += sizeof(e->valid);
-	memcpy(b + *i, &e->isDir, sizeof(e->isDir));
-	*i += sizeof(e->isDir);
-	memcpy(b + *i, &e->nameLen, sizeof(e->nameLen));
-	*i += sizeof(e->nameLen);
-	memcpy(b + *i, e->name, e->nameLen);
-	*i += e->nameLen;
-	memcpy(b + *i, &e->size, sizeof(e->size));
-	*i += sizeof(e->size);
-	memcpy(b + *i, &e->parentIdx, sizeof(e->parentIdx));
-	*i += sizeof(e->parentIdx);
-	memcpy(b + *i, &e->firstBlockIdx, sizeof(e->firstBlockIdx));
-	*i += sizeof(e->firstBlockIdx);
+	return ret;
 }
 
 /**
  * @param nmb number of metadata blocks
  */
 void clear_out_fat(size_t nmb, fs_table *fat, struct fs_settings *const fss) {
-	/* zero out blocks holding metadata */
-	memset(fat->blocks, 0, nmb * sizeof(fat_entry));
+	/* every data block is free */
+	init_free_map(nmb, fat, fss);
 
-	/* initialise the FAT as a free list */
-	for (size_t i = nmb; i < fat->size; i++)
-		fat->blocks[i] = (fat_entry){.used = 0, .next = i + 1};
+	/* no block is referred to, nor in the dedup index */
+	if (fat->refs != NULL)
+		memset(fat->refs, 0, sizeof(block_ref) * fat->size);
+	dedup_reset();
 
-	/* point the end of the free chain to SIZE_MAX */
-	fat->blocks[fat->size - 1].next = SIZE_MAX;
+	/* the whole table is rewritten on the next flush */
+	md_mark_all();
 
-	/* initialise free chain */
-	fss->freeListPtr = nmb;
+	if (fss->allocMode == ALLOC_EXTENT) {
+		init_extent_table(fat, fss);
+		return;
+	}
+
+	/* no block is part of a chain */
+	for (size_t i = 0; i < fat->size; i++)
+		fat->blocks[i] = (fat_entry){.next = NIL_IDX};
 }
 
 /**
@@ -525,11 +1301,17 @@ void clear_out_fat(size_t nmb, fs_table *fat, struct fs_settings *const fss) {
  * entry and garbage entries
  */
 _bool init_new_dir_t(int entryCount, fs_table *dt) {
-	dt->size = entryCount;
-	dt->dirs = malloc(sizeof(*dt->dirs) * dt->size);
+	dt->size   = entryCount;
+	dt->mapped = false;
+	dt->dirs   = malloc(sizeof(*dt->dirs) * dt->size);
+	dt->files  = calloc(dt->size, sizeof(*dt->files));
 
-	if (dt->dirs == NULL) {
+	if (dt->dirs == NULL || dt->files == NULL) {
 		perror("malloc() in init_new_dir_t()");
+		free(dt->dirs);
+		free(dt->files);
+		dt->dirs  = NULL;
+		dt->files = NULL;
 		return false;
 	}
 
@@ -537,6 +1319,17 @@ _bool init_new_dir_t(int entryCount, fs_table *dt) {
 	for (size_t i = 1; i < dt->size; i++)
 		dt->dirs[i] = DIR_TABLE_GARBAGE_ENTRY;
 
+	if (!init_name_heap(dt, NULL) || !store_name(ROOT_IDX, "/", 1, dt)) {
+		free_name_heap(dt);
+		free(dt->dirs);
+		free(dt->files);
+		dt->dirs  = NULL;
+		dt->files = NULL;
+		return false;
+	}
+
+	/* lookups fall back to a linear scan without it */
+	build_dir_index(dt, false);
 	return true;
 }
 
@@ -550,11 +1343,23 @@ _bool init_new_dir_t(int entryCount, fs_table *dt) {
  */
 _bool init_new_fat(size_t nb, size_t nmb, fs_table *fat,
 				  struct fs_settings *const fss) {
-	fat->size	= nb;
-	fat->blocks = malloc(fat->size * sizeof(fat_entry));
-
-	if (fat->blocks == NULL) {
+	fat->size	 = nb;
+	fat->mapped	 = false;
+	fat->blocks	 = malloc(fat->size * fat_entry_size(fss));
+	fat->freeMap = malloc(bitmap_words(fat->size) * sizeof(uint64_t));
+	fat->refs	 = fss->shareMode != SHARE_OFF
+					   ? malloc(sizeof(block_ref) * fat->size)
+					   : NULL;
+
+	if (fat->blocks == NULL || fat->freeMap == NULL ||
+		(fss->shareMode != SHARE_OFF && fat->refs == NULL)) {
 		perror("malloc() in init_new_fat()");
+		free(fat->blocks);
+		free(fat->freeMap);
+		free(fat->refs);
+		fat->blocks	 = NULL;
+		fat->freeMap = NULL;
+		fat->refs	 = NULL;
 		return false;
 	}
 
@@ -571,45 +1376,38 @@ _bool init_new_fat(size_t nb, size_t nmb, fs_table *fat,
  */
 _bool init_new_fs(struct fs_settings *const fss, fs_table *dt, fs_table *fat) {
 	/* open file for writing */
-	if ((fs = fopen(FS_NAME, "w+")) == NULL) {
-		perror("fopen() in init_new_fs()");
+	if ((fs = open(FS_NAME, O_RDWR | O_CREAT | O_TRUNC, 0644)) == -1) {
+		perror("open() in init_new_fs()");
 		return false;
 	}
 
 	/* create relevant tables in memory */
 	if (!init_new_dir_t(fss->entryCount, dt))
-		goto fclose;
+		goto close_fs;
 
-	if (!init_new_fat(fss->numBlocks, fss->numMdBlocks, fat, fss)) {
-		free(dt->dirs);
-		goto fclose;
-	}
+	if (!init_new_fat(fss->numBlocks, fss->numMdBlocks, fat, fss))
+		goto free_mem;
 
-	/* write garbage blocks to disk */
-	char *buf = calloc(fss->blockSize, sizeof(char));
-	if (buf == NULL) {
-		perror("calloc() in init_new_fs()");
-		free(dt->dirs);
-		free(fat->blocks);
-		goto fclose;
-	}
+	/* size the image in one go instead of writing out every block; they all
+	 * read back as zeros */
+	if (!size_fs(fss->numBlocks * fss->blockSize,
+				 fss->fmtMode == FORMAT_PREALLOC))
+		goto free_mem;
 
-	for (size_t i = 0; i < fss->numBlocks; i++) {
-		if (write_block(i, fss->blockSize, buf) != 0) {
-			fprintf(stderr, "init_new_fs(): failed at block #%zd\n", i);
-			free(dt->dirs);
-			free(fat->blocks);
-			free(buf);
-			goto fclose;
-		}
-	}
+	/* nothing is on disk yet, so every metadata block is dirty; write them
+	 * out before the journal starts depending on them */
+	if (!md_init(fss, dt, fat, true) || !journal_init(fss) ||
+		md_checkpoint(fss, dt, fat) != 0)
+		goto free_mem;
 
-	free(buf);
 	return true;
 
-fclose:
-	if (fclose(fs) == EOF)
-		perror("fclose() in init_new_fs()");
+free_mem:
+	free_tables(dt, fat);
+close_fs:
+	if (close(fs) == -1)
+		perror("close() in init_new_fs()");
+	fs = -1;
 	return false;
 }
 
@@ -617,11 +1415,19 @@ fclose:
  * @brief: resets state-relevant tables to make them available to write over
  */
 void format_fs(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
-	for (size_t i = 1; i < dt->size; i++)
-		remove_dir_entry(i, dt, fat, fss);
+	while (dt->dirs[ROOT_IDX].firstChild != NIL_IDX)
+		remove_dir_entry(dt->dirs[ROOT_IDX].firstChild, dt, fat, fss);
 	clear_out_fat(fss->numMdBlocks, fat, fss);
 }
 
+/**
+ * @return the size of one element of the table following the directory table:
+ * a FAT entry in chain mode, an extent record in extent mode
+ */
+size_t fat_entry_size(const struct fs_settings *fss) {
+	return fss->allocMode == ALLOC_EXTENT ? sizeof(extent) : sizeof(fat_entry);
+}
+
 /**
  * @brief determines the number of blocks and metadata blocks from other
  * provided information and updates the settings accordingly
@@ -629,11 +1435,22 @@ void format_fs(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 _bool compute_and_check_block_counts(struct fs_settings *const fss) {
 	fss->numBlocks = fss->size * 1024 * 1024 / fss->blockSize;
 
-	const size_t dirTBytes = MAX_SIZE_DIR_ENTRY * fss->entryCount,
-				 fatBytes  = sizeof(fat_entry) * fss->numBlocks,
-				 stBytes   = sizeof(struct fs_settings);
+	fss->numMdBlocks =
+		(md_size(fss) + fss->blockSize - 1) / fss->blockSize + fss->jnlBlocks;
 
-	fss->numMdBlocks = ((fatBytes + dirTBytes + stBytes) / fss->blockSize) + 1;
+	/* names are found by 32-bit offsets */
+	if (name_heap_size(fss->entryCount) > UINT32_MAX) {
+		fprintf(stderr, "init_new_fs(): Configuration error - too many "
+						"directory entries.\n");
+		return false;
+	}
+
+	/* blocks and extent records are linked by 32-bit indices */
+	if (fss->numBlocks >= NIL_IDX) {
+		fprintf(stderr, "init_new_fs(): Configuration error - too many "
+						"blocks; please use larger blocks.\n");
+		return false;
+	}
 
 	if (fss->numMdBlocks > fss->numBlocks) {
 		fprintf(stderr,
@@ -648,14 +1465,17 @@ _bool compute_and_check_block_counts(struct fs_settings *const fss) {
 }
 
 /**
- * @brief parse user args for filesystem creation. Unset or erroneous
+ * @brief parse user args. Format arguments only matter when a filesystem is
+ * being created; runtime arguments apply on every launch. Unset or erroneous
  * arguments are defaulted.
  */
-_bool parse_config_args(struct fs_settings *fss, int argc, char **argv) {
+_bool parse_config_args(struct fs_settings *fss, struct rt_settings *rts,
+						int argc, char **argv) {
 	int opt;
 	*fss = DEFAULT_CFG;
+	*rts = DEFAULT_RT_CFG;
 
-	while ((opt = getopt(argc, argv, "m:n:s:b:")) != -1) {
+	while ((opt = getopt(argc, argv, "m:n:s:b:a:j:f:c:i:e:g:l:pzd")) != -1) {
 		switch (opt) {
 		case 'm':
 			parse_and_set_ul(&fss->size, optarg);
@@ -669,15 +1489,95 @@ _bool parse_config_args(struct fs_settings *fss, int argc, char **argv) {
 		case 'b':
 			parse_and_set_ul(&fss->fMaxBlocks, optarg);
 			break;
+		case 'a':
+			if (strcmp(optarg, "extent") == 0)
+				fss->allocMode = ALLOC_EXTENT;
+			else if (strcmp(optarg, "chain") == 0)
+				fss->allocMode = ALLOC_CHAIN;
+			else
+				fprintf(stderr, "%s: unknown allocator; using chain\n", optarg);
+			break;
+		case 'j':
+			parse_and_set_ul(&fss->jnlBlocks, optarg);
+			break;
+		case 'f':
+			if (strcmp(optarg, "prealloc") == 0)
+				fss->fmtMode = FORMAT_PREALLOC;
+			else if (strcmp(optarg, "sparse") == 0)
+				fss->fmtMode = FORMAT_SPARSE;
+			else
+				fprintf(stderr, "%s: unknown format mode; using sparse\n",
+						optarg);
+			break;
+		case 'z':
+			fss->compMode = COMP_LZ;
+			break;
+		case 'd':
+			fss->shareMode = SHARE_DEDUP;
+			break;
+		case 'c':
+			parse_and_set_ul(&rts->cacheBlocks, optarg);
+			break;
+		case 'g':
+			parse_and_set_ul(&rts->groupCommit, optarg);
+			break;
+		case 'l':
+			parse_and_set_ul(&rts->pageMd, optarg);
+			break;
+		case 'p':
+			rts->punchHoles = true;
+			break;
+		case 'i':
+			if (strcmp(optarg, "mmap") == 0)
+				rts->ioMode = IO_MMAP;
+			else if (strcmp(optarg, "stdio") == 0)
+				rts->ioMode = IO_STDIO;
+			else
+				fprintf(stderr, "%s: unknown I/O mode; using stdio\n", optarg);
+			break;
+		case 'e':
+			if (strcmp(optarg, "uring") == 0)
+				rts->aioMode = AIO_URING;
+			else if (strcmp(optarg, "threads") == 0)
+				rts->aioMode = AIO_THREADS;
+			else if (strcmp(optarg, "off") == 0)
+				rts->aioMode = AIO_OFF;
+			else
+				fprintf(stderr, "%s: unknown async engine; using uring\n",
+						optarg);
+			break;
 		default:
 			fprintf(stderr,
 					"Usage: %s [-m size-in-MBs] [-n entry-count]  [-s "
-					"block-size] [-b file-max-block-count]\n",
+					"block-size] [-b file-max-block-count] [-a "
+					"chain|extent] [-j journal-block-count] [-f "
+					"sparse|prealloc] [-z] [-d] [-c cache-block-count] [-i "
+					"stdio|mmap] [-e uring|threads|off] [-g ops-per-commit] "
+					"[-l MBs] [-p]\n",
 					argv[0]);
 			return false;
 		}
 	}
 
+	/* each cluster takes a run of blocks of its own */
+	if (fss->compMode != COMP_OFF && fss->allocMode != ALLOC_EXTENT) {
+		fprintf(stderr, "-z: compression needs extent mode; using it\n");
+		fss->allocMode = ALLOC_EXTENT;
+	}
+
+	/* a cluster's run is rewritten in place, so it can't be shared */
+	if (fss->shareMode != SHARE_OFF && fss->compMode != COMP_OFF) {
+		fprintf(stderr, "-d: compressed blocks can't be shared; not "
+						"sharing them\n");
+		fss->shareMode = SHARE_OFF;
+	}
+
+	/* a block can be in any number of runs, but only one chain */
+	if (fss->shareMode != SHARE_OFF && fss->allocMode != ALLOC_EXTENT) {
+		fprintf(stderr, "-d: shared blocks need extent mode; using it\n");
+		fss->allocMode = ALLOC_EXTENT;
+	}
+
 	if (optind < argc) {
 		fprintf(stderr, "Ignoring non-option argv-elements: ");
 		while (optind < argc)
@@ -685,8 +1585,5 @@ _bool parse_config_args(struct fs_settings *fss, int argc, char **argv) {
 		printf("\n");
 	}
 
-	if (!compute_and_check_block_counts(fss))
-		return false;
-
 	return true;
 }
@@ -0,0 +1,248 @@
+#define _GNU_SOURCE /* pthread_rwlockattr_setkind_np() */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../include/aio.h"
+#include "../include/cache.h"
+#include "../include/defaults.h"
+#include "../include/gfs.h"
+#include "../include/journal.h"
+#include "../include/metadata.h"
+#include "../include/readahead.h"
+#include "../include/utils.h"
+
+/*
+ * Locking: lookups and reads take `mdLock` shared, and then the lock of the
+ * file they touch, since reading may build the file's block map. Block I/O is
+ * positional and the block cache has a lock of its own, so reads of different
+ * files proceed in parallel. Everything that changes metadata (including
+ * writes, which allocate blocks and feed the journal) takes `mdLock`
+ * exclusively, which also keeps every reader out.
+ */
+
+int fs = -1;
+
+static void lock_file(ghonsla_fs *h, size_t i) {
+	pthread_rwlock_rdlock(&h->mdLock);
+	if (i < h->dt.size)
+		pthread_mutex_lock(&h->fileLocks[i]);
+}
+
+static void unlock_file(ghonsla_fs *h, size_t i) {
+	if (i < h->dt.size)
+		pthread_mutex_unlock(&h->fileLocks[i]);
+	pthread_rwlock_unlock(&h->mdLock);
+}
+
+static _bool init_locks(ghonsla_fs *h) {
+	pthread_rwlockattr_t attr;
+
+	if ((h->fileLocks = malloc(h->dt.size * sizeof(*h->fileLocks))) == NULL) {
+		perror("malloc() in init_locks()");
+		return false;
+	}
+
+	for (size_t i = 0; i < h->dt.size; i++)
+		pthread_mutex_init(&h->fileLocks[i], NULL);
+
+	/* a steady stream of readers mustn't starve writers */
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr,
+								  PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&h->mdLock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+
+	return true;
+}
+
+/**
+ * @brief releases everything the handle holds, however far gfs_open() got
+ */
+static void teardown(ghonsla_fs *h) {
+	/* readahead may still have reads in flight */
+	for (size_t i = 0; h->dt.files != NULL && i < h->dt.size; i++)
+		readahead_drop(&h->dt.files[i]);
+	md_destroy();
+	journal_destroy();
+	aio_destroy();
+	cache_destroy();
+	unmap_fs();
+
+	if (fs != -1 && close(fs) == -1)
+		perror("close() in teardown()");
+	fs = -1;
+
+	if (h->fileLocks != NULL) {
+		for (size_t i = 0; i < h->dt.size; i++)
+			pthread_mutex_destroy(&h->fileLocks[i]);
+		pthread_rwlock_destroy(&h->mdLock);
+		free(h->fileLocks);
+	}
+
+	free_tables(&h->dt, &h->fat);
+	free(h);
+}
+
+/**
+ * @brief opens the filesystem file if it exists, or creates a new one as per
+ * `fss` if not, and sets up I/O as per `rts`
+ *
+ * @return NULL on failure
+ */
+ghonsla_fs *gfs_open(const struct fs_settings *fss,
+					 const struct rt_settings *rts) {
+	ghonsla_fs *h = malloc(sizeof(*h));
+	if (h == NULL) {
+		perror("malloc() in gfs_open()");
+		return NULL;
+	}
+
+	h->fss		 = *fss;
+	h->rts		 = *rts;
+	h->dt		 = (fs_table){.size = 0, .dirs = NULL};
+	h->fat		 = (fs_table){.size = 0, .blocks = NULL};
+	h->fileLocks = NULL;
+
+	/* couldn't open */
+	if ((fs = open(FS_NAME, O_RDWR)) == -1 && errno != ENOENT) {
+		perror("open() in gfs_open()");
+		free(h);
+		return NULL;
+	}
+
+	md_set_paging(rts->pageMd << 20);
+
+	if (fs == -1) {
+		/* generate */
+		if (!compute_and_check_block_counts(&h->fss) ||
+			!init_new_fs(&h->fss, &h->dt, &h->fat))
+			goto fail;
+	} else if (!deserialise_metadata(&h->fss, &h->dt, &h->fat)) {
+		/* open and reload */
+		goto fail;
+	}
+
+	h->fd = fs;
+	journal_set_batch(rts->groupCommit);
+	set_hole_punching(rts->punchHoles);
+
+	/* the mapping replaces the cache rather than sitting under it */
+	_bool io = rts->ioMode == IO_MMAP
+				   ? map_fs(h->fss.numBlocks * h->fss.blockSize)
+				   : cache_init(rts->cacheBlocks, h->fss.blockSize);
+
+	/* falls back to threads, or to synchronous I/O, by itself */
+	aio_init(rts->aioMode, AIO_DEPTH);
+
+	if (!io || !init_locks(h))
+		goto fail;
+
+	return h;
+
+fail:
+	teardown(h);
+	return NULL;
+}
+
+/**
+ * @brief checkpoints the filesystem and releases everything the handle holds.
+ * No other thread may be using the handle.
+ */
+void gfs_close(ghonsla_fs *h) {
+	serialise_metadata(&h->fss, &h->dt, &h->fat);
+	teardown(h);
+}
+
+_bool gfs_sync(ghonsla_fs *h) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = serialise_metadata(&h->fss, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+/**
+ * @brief gfs_sync(), but every metadata block is written to its home
+ * location, whether it changed or not
+ */
+_bool gfs_sync_all(ghonsla_fs *h) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	md_mark_all();
+	_bool ret = serialise_metadata(&h->fss, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+size_t gfs_lookup(ghonsla_fs *h, const char *name, size_t dir) {
+	pthread_rwlock_rdlock(&h->mdLock);
+	size_t i = get_index_of_dir_entry(name, dir, &h->dt);
+	pthread_rwlock_unlock(&h->mdLock);
+	return i;
+}
+
+_bool gfs_create(ghonsla_fs *h, const char *name, size_t dir, _bool isDir) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = create_dir_entry(name, dir, isDir, &h->dt);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+_bool gfs_remove(ghonsla_fs *h, size_t i) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = remove_dir_entry(i, &h->dt, &h->fat, &h->fss);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+_bool gfs_rename(ghonsla_fs *h, const char *name, size_t i) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = rename_dir_entry(name, i, &h->dt, &h->fat, &h->fss);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+_bool gfs_clone(ghonsla_fs *h, size_t i, const char *name, size_t dir) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = clone_file(i, name, dir, &h->fss, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+_bool gfs_truncate(ghonsla_fs *h, size_t i) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	_bool ret = truncate_file(i, &h->dt, &h->fat, &h->fss);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+int gfs_read(ghonsla_fs *h, size_t i, char *buf, size_t size, size_t pos) {
+	lock_file(h, i);
+	int ret = read_file_at(i, buf, size, &h->fss, pos, &h->dt, &h->fat);
+	unlock_file(h, i);
+	return ret;
+}
+
+int gfs_write(ghonsla_fs *h, size_t i, const char *buf, size_t size,
+			  size_t pos) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	int ret = write_to_file(i, buf, size, &h->fss, pos, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+int gfs_append(ghonsla_fs *h, size_t i, const char *buf, size_t size) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	int ret = append_to_file(i, buf, size, &h->fss, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
+
+int gfs_flush(ghonsla_fs *h, size_t i) {
+	pthread_rwlock_wrlock(&h->mdLock);
+	int ret = flush_file(i, &h->fss, &h->dt, &h->fat);
+	pthread_rwlock_unlock(&h->mdLock);
+	return ret;
+}
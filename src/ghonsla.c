@@ -1,24 +1,26 @@
 #include <curses.h>
-#include <errno.h>
 #include <stdio.h>
 #include <string.h>
+#include <unistd.h>
 
 #include <menu.h>
 #undef _bool
 
+#include "../include/cache.h"
 #include "../include/defaults.h"
 #include "../include/ghonsla.h"
+#include "../include/names.h"
 #include "../include/utils.h"
 
-FILE *fs = NULL;
-
-void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
-	int cwd		= ROOT_IDX;
-	int menuIdx = -1;
+void ui(ghonsla_fs *h) {
+	struct fs_settings *fss = &h->fss;
+	fs_table *dt			= &h->dt;
+	int cwd					= ROOT_IDX;
+	int menuIdx				= -1;
 	int input;
 	_bool chdir = false, leave = false;
 	size_t tmp;
-	char *name = NULL;
+	char name[MAX_NAME_LEN + 1];
 
 	/* TODO: handle errors */
 	initscr();
@@ -35,7 +37,7 @@ void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 		ITEM **cwdMenuItems = calloc(childCount + 1, sizeof(ITEM *));
 
 		for (size_t i = 0; i < childCount; i++)
-			cwdMenuItems[i] = new_item(entries[i]->name, NULL);
+			cwdMenuItems[i] = new_item(entry_name(dt, entries[i]), NULL);
 		cwdMenuItems[childCount] = NULL;
 
 		MENU *cwdMenu = new_menu(cwdMenuItems);
@@ -43,13 +45,18 @@ void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 		menuIdx = item_index(current_item(cwdMenu));
 		mvprintw(LINES - 2, 0,
 				 "Size (MBs): %zu | Entry Count: %zu | Block Size: %zu | "
-				 "FreeListPtr: %zu",
-				 fss->size, fss->entryCount, fss->blockSize, fss->freeListPtr);
+				 "Free Blocks: %zu",
+				 fss->size, fss->entryCount, fss->blockSize, fss->freeBlocks);
 		mvprintw(
 			LINES - 1, 0,
 			"Max Blocks: %zu | Number Blocks FS: %zu | Number MD Blocks: %zu",
 			fss->fMaxBlocks, fss->numBlocks, fss->numMdBlocks);
-		mvprintw(LINES - 3, 0, "cwd: %d", cwd);
+		struct cache_stats cs = cache_get_stats();
+		mvprintw(LINES - 3, 0,
+				 "cwd: %d | I/O: %s | Cache: %zu blocks, %zu hits, %zu "
+				 "misses, %zu write-backs",
+				 cwd, h->rts.ioMode == IO_MMAP ? "mmap" : "stdio",
+				 cs.capacity, cs.hits, cs.misses, cs.writeBacks);
 		refresh();
 
 		/* stay in menu while the user hasn't tried to leave or chdir */
@@ -73,7 +80,7 @@ void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 				if (childCount <= 0)
 					break;
 
-				tmp = get_index_of_dir_entry(entries[menuIdx]->name, cwd, dt);
+				tmp = gfs_lookup(h, entry_name(dt, entries[menuIdx]), cwd);
 				if (entries[menuIdx]->isDir) {
 					chdir = true;
 					cwd	  = tmp;
@@ -91,27 +98,38 @@ void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 
 			case 't': /* touch */
 				echo();
-				name = malloc(MAX_NAME_LEN);
 				mvprintw(LINES - 4, 0, "File name: ");
 				mvgetnstr(LINES - 4, 11, name, MAX_NAME_LEN);
-				create_dir_entry(name, cwd, false, dt);
+				gfs_create(h, name, cwd, false);
 				noecho();
 				chdir = true;
 				break;
 
 			case 'm': /* mkdir */
 				echo();
-				name = malloc(MAX_NAME_LEN);
 				mvprintw(LINES - 4, 0, "Dir name: ");
 				mvgetnstr(LINES - 4, 10, name, MAX_NAME_LEN);
-				create_dir_entry(name, cwd, true, dt);
+				gfs_create(h, name, cwd, true);
 				noecho();
 				chdir = true;
 				break;
 
 			case 'r': /* remove */
-				tmp = get_index_of_dir_entry(entries[menuIdx]->name, cwd, dt);
-				remove_dir_entry(tmp, dt, fat, fss);
+				tmp = gfs_lookup(h, entry_name(dt, entries[menuIdx]), cwd);
+				gfs_remove(h, tmp);
+				chdir = true;
+				break;
+
+			case 'c': /* clone */
+				if (childCount <= 0 || entries[menuIdx]->isDir)
+					break;
+
+				tmp = gfs_lookup(h, entry_name(dt, entries[menuIdx]), cwd);
+				echo();
+				mvprintw(LINES - 4, 0, "Clone name: ");
+				mvgetnstr(LINES - 4, 12, name, MAX_NAME_LEN);
+				gfs_clone(h, tmp, name, cwd);
+				noecho();
 				chdir = true;
 				break;
 
@@ -133,60 +151,30 @@ void ui(struct fs_settings *fss, fs_table *dt, fs_table *fat) {
 }
 
 int main(int argc, char **argv) {
-	fs_table dt			   = {.size = 0, .dirs = NULL};
-	fs_table fat		   = {.size = 0, .blocks = NULL};
-	struct fs_settings fss = DEFAULT_CFG;
-
-	int ret = 0;
-
-	if (!init_fs(&fss, argc, argv, &dt, &fat))
+	ghonsla_fs *h = init_fs(argc, argv);
+	if (h == NULL)
 		return 1;
 
-	ui(&fss, &dt, &fat);
-
-	serialise_metadata(&fss, &dt, &fat);
-	format_fs(&fss, &dt, &fat);
-
-	if (fclose(fs) == EOF)
-		perror("fclose() in main()");
-
-	free(dt.dirs);
-	free(fat.blocks);
+	ui(h);
+	gfs_close(h);
 
-	return ret;
+	return 0;
 }
 
 /**
  * @details opens the filesystem file if it exists, or creates a new one if not
  */
-_bool init_fs(struct fs_settings *fss, int argc, char **argv, fs_table *const dt,
-			 fs_table *const fat) {
-
-	/* couldn't open */
-	if ((fs = fopen(FS_NAME, "r+")) == NULL && errno != ENOENT) {
-		perror("fopen() in init_fs()");
-		return false;
-	}
-
-	/* generate */
-	if (errno == ENOENT) {
-		if (!parse_config_args(fss, argc, argv) || !init_new_fs(fss, dt, fat))
-			return false;
-		/* tests_generate(fss, dt, fat); */
-		return true;
-	}
-
-	/* open and reload */
-	if (argc > 1)
-		printf("Disk file found, ignoring args\n");
-
-	return deserialise_metadata(fss, dt, fat);
-	/* if (!deserialise_metadata(fss, dt, fat)) */
-	/* 	return false; */
-
-	/* tests_deserialise(dt); */
-
-	/* return true; */
+ghonsla_fs *init_fs(int argc, char **argv) {
+	struct fs_settings fss = DEFAULT_CFG;
+	struct rt_settings rts = DEFAULT_RT_CFG;
+
+	if (!parse_config_args(&fss, &rts, argc, argv))
+		return NULL;
+
+	if (argc > 1 && access(FS_NAME, F_OK) == 0)
+		printf("Disk file found, ignoring format args\n");
+
+	return gfs_open(&fss, &rts);
 }
 
 void tests_deserialise(fs_table *const dt) {
@@ -211,28 +199,25 @@ void tests_deserialise(fs_table *const dt) {
 
 void tests_generate(struct fs_settings *const fss, fs_table *const dt,
 					fs_table *const fat) {
-	char *firstDir	= copy_string("firstDir");
-	char *f1name	= copy_string("f1");
-	char *f2name	= copy_string("f2");
-	char *f3name	= copy_string("f3");
-	char *rename	= copy_string("f2_renamed");
-	char *secondDir = copy_string("secondDir");
-	char *f4name	= copy_string("f4");
-	/* these get freed @ format time or by rename/remove operations */
+	const char *firstDir  = "firstDir";
+	const char *f1name	  = "f1";
+	const char *f2name	  = "f2";
+	const char *f3name	  = "f3";
+	const char *rename	  = "f2_renamed";
+	const char *secondDir = "secondDir";
+	const char *f4name	  = "f4";
 
 	create_dir_entry(firstDir, ROOT_IDX, true, dt);
 	create_dir_entry(f1name, ROOT_IDX, false, dt);
 
 	size_t idx = get_index_of_dir_entry(f1name, ROOT_IDX, dt);
 	remove_dir_entry(idx, dt, fat, fss);
-	f1name = NULL;
 
 	create_dir_entry(f2name, 1, false, dt);
 	create_dir_entry(f3name, 1, false, dt);
 
 	idx = get_index_of_dir_entry(f2name, 1, dt);
-	rename_dir_entry(rename, idx, dt);
-	f2name = NULL;
+	rename_dir_entry(rename, idx, dt, fat, fss);
 
 	printf("firstDir:\n");
 	idx = get_index_of_dir_entry(firstDir, ROOT_IDX, dt);
@@ -0,0 +1,342 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/defaults.h"
+#include "../include/journal.h"
+#include "../include/utils.h"
+
+/*
+ * The journal is an append-only log kept in the last `jnlBlocks` blocks of
+ * the metadata region. Each record is an after-image of a byte range of the
+ * metadata region: (offset, length, bytes). Records are packed into journal
+ * blocks, and the blocks written by one commit form a transaction:
+ *
+ * 	[header | record record ...] [header | record ...] ... <- last has `commit`
+ *
+ * Every header carries a running checksum of its transaction's payloads, so a
+ * transaction whose blocks didn't all reach the disk is recognised and
+ * dropped on replay. Headers also carry the journal's generation (`seq`).
+ * Each checkpoint writes all metadata to its home location, bumps the
+ * generation stored in the settings, and starts the log over. Records from
+ * older generations are ignored from then on.
+ */
+
+#define JNL_MAGIC 0x4c4e4a47u /* "GJNL" */
+#define REC_HDR	  (sizeof(uint64_t) + sizeof(uint32_t))
+#define SUM_INIT  2166136261u
+
+typedef struct {
+	uint32_t magic;
+	uint32_t used;	 /* payload bytes taken by records */
+	uint64_t seq;	 /* generation the block was written in */
+	uint64_t txn;	 /* transaction the block belongs to */
+	uint32_t commit; /* set on the last block of a transaction */
+	uint32_t sum;	 /* checksum of the transaction's payloads up to here */
+} jnl_header;
+
+static struct {
+	size_t blockSize;
+	size_t start;	 /* first block of the journal */
+	size_t nBlocks;	 /* 0 if journalling is disabled */
+	size_t seq;		 /* current generation */
+	size_t tail;	 /* next journal block to be written */
+	size_t txn;		 /* next transaction number */
+	size_t batchOps; /* operations per commit */
+	char *batch;	 /* blocks of the transaction being built */
+	size_t batchLen; /* number of blocks in `batch` */
+	struct journal_stats stats;
+} j = {.nBlocks = 0, .batchOps = GROUP_SIZE};
+
+static size_t payload_size(void) { return j.blockSize - sizeof(jnl_header); }
+static char *batch_block(size_t k) { return j.batch + k * j.blockSize; }
+
+static uint32_t checksum(const char *b, size_t len, uint32_t h) {
+	/* FNV-1a */
+	for (size_t i = 0; i < len; i++)
+		h = (h ^ (unsigned char)b[i]) * 16777619u;
+	return h;
+}
+
+/**
+ * @brief sets up the journal described by `fss`. Journalling stays disabled
+ * if the filesystem was created without a journal, or if its blocks are too
+ * small to hold a header and a record.
+ */
+_bool journal_init(const struct fs_settings *fss) {
+	journal_destroy();
+
+	if (fss->jnlBlocks == 0 || fss->blockSize <= sizeof(jnl_header) + REC_HDR)
+		return true;
+
+	if ((j.batch = malloc(fss->jnlBlocks * fss->blockSize)) == NULL) {
+		perror("malloc() in journal_init()");
+		return false;
+	}
+
+	j.blockSize = fss->blockSize;
+	j.start		= fss->numMdBlocks - fss->jnlBlocks;
+	j.nBlocks	= fss->jnlBlocks;
+	j.seq		= fss->jnlSeq;
+	j.tail = j.txn = j.batchLen = 0;
+	j.stats						= (struct journal_stats){.commits = 0};
+	return true;
+}
+
+void journal_destroy(void) {
+	free(j.batch);
+	j.batch	  = NULL;
+	j.nBlocks = 0;
+}
+
+_bool journal_enabled(void) { return j.nBlocks > 0; }
+
+void journal_set_batch(size_t ops) { j.batchOps = MAX(ops, 1); }
+size_t journal_batch(void) { return j.batchOps; }
+
+/**
+ * @return a lower bound on the number of bytes of after-images an empty
+ * journal can hold
+ */
+size_t journal_capacity(void) {
+	return j.nBlocks == 0 ? 0 : j.nBlocks * (payload_size() - REC_HDR);
+}
+
+/**
+ * @brief adds the after-image of `len` bytes at offset `off` of the metadata
+ * region to the transaction being built, splitting it across blocks if need
+ * be. Nothing is written until journal_commit().
+ *
+ * @return 0 on success, -1 if the journal is out of space
+ */
+int journal_append(size_t off, const char *src, size_t len) {
+	const size_t payload = payload_size();
+	jnl_header h;
+
+	while (len > 0) {
+		char *b = j.batchLen > 0 ? batch_block(j.batchLen - 1) : NULL;
+		if (b != NULL)
+			memcpy(&h, b, sizeof(h));
+
+		if (b == NULL || payload - h.used <= REC_HDR) {
+			if (j.tail + j.batchLen == j.nBlocks)
+				return -1;
+
+			b = batch_block(j.batchLen++);
+			memset(b, 0, j.blockSize);
+			h = (jnl_header){.magic = JNL_MAGIC, .seq = j.seq, .txn = j.txn};
+		}
+
+		char *p	   = b + sizeof(h) + h.used;
+		uint64_t o = off;
+		uint32_t n = MIN(len, payload - h.used - REC_HDR);
+
+		memcpy(p, &o, sizeof(o));
+		memcpy(p + sizeof(o), &n, sizeof(n));
+		memcpy(p + REC_HDR, src, n);
+
+		h.used += REC_HDR + n;
+		memcpy(b, &h, sizeof(h));
+
+		off += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief writes the transaction built so far to the journal and makes it
+ * durable. Every data block written before it is made durable first, with a
+ * sync of its own, so a committed transaction never refers to data that
+ * didn't reach the disk.
+ *
+ * @return 0 on success, negative on failure
+ */
+int journal_commit(void) {
+	if (j.batchLen == 0)
+		return 0;
+
+	if (sync_fs() != 0) {
+		journal_discard();
+		return -2;
+	}
+
+	uint32_t sum = SUM_INIT;
+	jnl_header h;
+
+	for (size_t k = 0; k < j.batchLen; k++) {
+		char *b = batch_block(k);
+
+		memcpy(&h, b, sizeof(h));
+		sum		 = checksum(b + sizeof(h), h.used, sum);
+		h.sum	 = sum;
+		h.commit = k == j.batchLen - 1;
+		memcpy(b, &h, sizeof(h));
+	}
+
+	if (write_blocks(j.start + j.tail, j.batchLen, j.blockSize, j.batch) != 0) {
+		journal_discard();
+		return -1;
+	}
+
+	j.tail += j.batchLen;
+	j.txn++;
+	j.batchLen = 0;
+
+	if (sync_fs() != 0)
+		return -2;
+
+	j.stats.commits++;
+	return 0;
+}
+
+/**
+ * @brief drops the transaction being built
+ */
+void journal_discard(void) { j.batchLen = 0; }
+
+/**
+ * @brief starts the log over under a new generation; called once a
+ * checkpoint has made everything in the journal redundant
+ */
+void journal_reset(size_t seq) {
+	j.seq  = seq;
+	j.tail = j.txn = j.batchLen = 0;
+	j.stats.checkpoints++;
+}
+
+typedef int (*apply_fn)(size_t off, const char *src, size_t len, void *arg);
+
+/**
+ * @brief hands each record of a journal block to `apply`
+ *
+ * @return 0 on success, negative if `apply` failed
+ */
+static int apply_block(const char *b, apply_fn apply, void *arg) {
+	jnl_header h;
+	memcpy(&h, b, sizeof(h));
+
+	for (size_t i = 0; i + REC_HDR <= h.used;) {
+		const char *p = b + sizeof(h) + i;
+		uint64_t off;
+		uint32_t len;
+
+		memcpy(&off, p, sizeof(off));
+		memcpy(&len, p + sizeof(off), sizeof(len));
+
+		if (apply(off, p + REC_HDR, len, arg) != 0)
+			return -1;
+
+		i += REC_HDR + len;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief hands every record of every fully committed transaction of the
+ * current generation to `apply`, in the order they were logged
+ *
+ * @return the number of journal blocks of the current generation that were
+ * found, committed or not, negative on failure
+ */
+static long scan(apply_fn apply, void *arg) {
+	if (j.nBlocks == 0)
+		return 0;
+
+	char b[j.blockSize];
+	uint32_t sum = SUM_INIT;
+	size_t txn = 0, first = 0;
+	long seen  = 0;
+	jnl_header h;
+
+	for (size_t k = 0; k < j.nBlocks; k++) {
+		if (read_block(j.start + k, j.blockSize, b) != 0)
+			return -1;
+
+		memcpy(&h, b, sizeof(h));
+		if (h.magic != JNL_MAGIC || h.seq != j.seq || h.txn != txn ||
+			h.used > payload_size())
+			break;
+
+		seen++;
+		if ((sum = checksum(b + sizeof(h), h.used, sum)) != h.sum)
+			break;
+
+		if (!h.commit)
+			continue;
+
+		/* every block of the transaction made it to disk */
+		for (size_t t = first; t <= k; t++) {
+			if (read_block(j.start + t, j.blockSize, b) != 0 ||
+				apply_block(b, apply, arg) != 0)
+				return -1;
+		}
+
+		txn++;
+		first = k + 1;
+		sum	  = SUM_INIT;
+	}
+
+	return seen;
+}
+
+typedef struct {
+	char *md;
+	size_t len;
+} md_image;
+
+static int apply_to_image(size_t off, const char *src, size_t len,
+						  void *arg) {
+	md_image *img = arg;
+	if (off + len <= img->len)
+		memcpy(img->md + off, src, len);
+	return 0;
+}
+
+/**
+ * @brief applies every fully committed transaction of the current generation
+ * to `md`, an image of the metadata region read from its home location
+ *
+ * @return the number of journal blocks of the current generation that were
+ * found, committed or not, negative on failure; if positive, the caller
+ * should checkpoint so the journal can be started over
+ */
+long journal_replay(char *md, size_t mdLen) {
+	md_image img = {.md = md, .len = mdLen};
+	return scan(apply_to_image, &img);
+}
+
+static int apply_home(size_t off, const char *src, size_t len, void *arg) {
+	(void)arg;
+	char b[j.blockSize];
+
+	while (len > 0) {
+		const size_t blk = off / j.blockSize, in = off % j.blockSize;
+		const size_t n	 = MIN(len, j.blockSize - in);
+
+		if (blk >= j.start || read_block(blk, j.blockSize, b) != 0)
+			return -1;
+		memcpy(b + in, src, n);
+		if (write_block(blk, j.blockSize, b) != 0)
+			return -1;
+
+		off += n;
+		src += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief writes every fully committed transaction of the current generation
+ * to its home location, so the metadata region holds what the journal does;
+ * nothing is synced
+ *
+ * @return 0 on success, negative on failure
+ */
+int journal_fold(void) { return scan(apply_home, NULL) < 0 ? -1 : 0; }
+
+struct journal_stats journal_get_stats(void) { return j.stats; }
@@ -0,0 +1,227 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "../include/lz.h"
+#include "../include/utils.h"
+
+/*
+ * A byte-oriented LZ77 codec in the spirit of LZ4: no entropy coding, just
+ * literals and back-references, so both directions run at memory speed.
+ *
+ * The output is a series of sequences, each of
+ *  - a token byte: the number of literals in its high nibble, and the match
+ *    length, less LZ_MIN_MATCH, in its low one; a nibble of 15 is followed by
+ *    bytes adding to it, up to and including the first one that isn't 255
+ *  - the literals themselves
+ *  - the match's distance back into the output, 16-bit little endian
+ * The last sequence ends after its literals, with no match.
+ *
+ * Matches are found through a hash table of the last position each 4-byte
+ * string was seen at, so only the most recent candidate is ever tried.
+ */
+
+#define LZ_MIN_MATCH 4
+#define LZ_MAX_DIST	 0xFFFF
+#define LZ_HASH_BITS 12
+#define LZ_SKIP_SHIFT 5 /* misses in a row before each step grows by one */
+
+static uint32_t read32(const uint8_t *p) {
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint64_t read64(const uint8_t *p) {
+	uint64_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+/**
+ * @return the number of leading bytes two 8-byte loads that differ, as `diff`
+ * has it, have in common
+ */
+static size_t common_bytes(uint64_t diff) {
+#if __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	return __builtin_clzll(diff) / 8;
+#else
+	return __builtin_ctzll(diff) / 8;
+#endif
+}
+
+static size_t hash(uint32_t v) {
+	return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+/**
+ * @brief writes what a nibble of 15 leaves of a length
+ *
+ * @return the byte after it, NULL if there's no room
+ */
+static uint8_t *put_len(uint8_t *op, const uint8_t *oend, size_t len) {
+	for (; len >= 255; len -= 255) {
+		if (op == oend)
+			return NULL;
+		*op++ = 255;
+	}
+
+	if (op == oend)
+		return NULL;
+	*op++ = len;
+	return op;
+}
+
+/**
+ * @brief writes one sequence: `nLit` literals from `lit`, followed by a
+ * match `mLen` bytes long, `dist` bytes back; no match if `mLen` is 0
+ *
+ * @return the byte after it, NULL if there's no room
+ */
+static uint8_t *put_seq(uint8_t *op, const uint8_t *oend, const uint8_t *lit,
+						size_t nLit, size_t dist, size_t mLen) {
+	const size_t ml = mLen > 0 ? mLen - LZ_MIN_MATCH : 0;
+
+	if (op == oend)
+		return NULL;
+	*op++ = (MIN(nLit, 15) << 4) | MIN(ml, 15);
+
+	if (nLit >= 15 && (op = put_len(op, oend, nLit - 15)) == NULL)
+		return NULL;
+
+	if ((size_t)(oend - op) < nLit)
+		return NULL;
+	memcpy(op, lit, nLit);
+	op += nLit;
+
+	if (mLen == 0)
+		return op;
+
+	if (oend - op < 2)
+		return NULL;
+	*op++ = dist & 0xFF;
+	*op++ = dist >> 8;
+
+	if (ml >= 15 && (op = put_len(op, oend, ml - 15)) == NULL)
+		return NULL;
+	return op;
+}
+
+/**
+ * @brief compresses `n` bytes of `src` into `dst`
+ *
+ * @return the compressed size, 0 if it's more than `cap` bytes
+ */
+size_t lz_compress(const char *src, size_t n, char *dst, size_t cap) {
+	const uint8_t *in = (const uint8_t *)src, *end = in + n;
+	const uint8_t *ip = in, *anchor = in;
+	uint8_t *op = (uint8_t *)dst, *const oend = op + cap;
+	uint32_t table[1 << LZ_HASH_BITS] = {0};
+	size_t misses					  = 0;
+
+	while (n >= LZ_MIN_MATCH && ip <= end - LZ_MIN_MATCH) {
+		const uint32_t seq = read32(ip);
+		const size_t h	   = hash(seq);
+		const uint8_t *ref = in + table[h];
+		table[h]		   = ip - in;
+
+		/* the longer nothing matches, the faster it's skipped over */
+		if (ref >= ip || ip - ref > LZ_MAX_DIST || read32(ref) != seq) {
+			ip += 1 + (misses++ >> LZ_SKIP_SHIFT);
+			continue;
+		}
+
+		misses		= 0;
+		size_t mLen = LZ_MIN_MATCH;
+		while (ip + mLen + 8 <= end) {
+			const uint64_t diff = read64(ip + mLen) ^ read64(ref + mLen);
+			if (diff != 0) {
+				mLen += common_bytes(diff);
+				break;
+			}
+			mLen += 8;
+		}
+		while (ip + mLen < end && ref[mLen] == ip[mLen])
+			mLen++;
+
+		op = put_seq(op, oend, anchor, ip - anchor, ip - ref, mLen);
+		if (op == NULL)
+			return 0;
+
+		ip += mLen;
+		anchor = ip;
+	}
+
+	op = put_seq(op, oend, anchor, end - anchor, 0, 0);
+	return op == NULL ? 0 : op - (uint8_t *)dst;
+}
+
+/**
+ * @brief reads what a nibble of 15 leaves of a length
+ *
+ * @return false if the input ends first
+ */
+static _bool get_len(const uint8_t **ip, const uint8_t *iend, size_t *len) {
+	uint8_t b;
+	do {
+		if (*ip == iend)
+			return false;
+		b = *(*ip)++;
+		*len += b;
+	} while (b == 255);
+
+	return true;
+}
+
+/**
+ * @brief decompresses `n` bytes of `src` into `dst`, checking every length
+ * and distance against both buffers, so damaged input can't take it out of
+ * bounds
+ *
+ * @return true if it held exactly `out` bytes
+ */
+_bool lz_decompress(const char *src, size_t n, char *dst, size_t out) {
+	const uint8_t *ip = (const uint8_t *)src, *const iend = ip + n;
+	uint8_t *op = (uint8_t *)dst, *const oend = op + out;
+
+	while (ip < iend) {
+		const uint8_t token = *ip++;
+
+		size_t nLit = token >> 4;
+		if (nLit == 15 && !get_len(&ip, iend, &nLit))
+			return false;
+		if ((size_t)(iend - ip) < nLit || (size_t)(oend - op) < nLit)
+			return false;
+		memcpy(op, ip, nLit);
+		ip += nLit;
+		op += nLit;
+
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		const size_t dist = ip[0] | (ip[1] << 8);
+		ip += 2;
+
+		size_t mLen = token & 15;
+		if (mLen == 15 && !get_len(&ip, iend, &mLen))
+			return false;
+		mLen += LZ_MIN_MATCH;
+
+		if (dist == 0 || dist > (size_t)(op - (uint8_t *)dst) ||
+			(size_t)(oend - op) < mLen)
+			return false;
+
+		/* the match may overlap the bytes it produces */
+		const uint8_t *ref = op - dist;
+		if (dist >= mLen) {
+			memcpy(op, ref, mLen);
+			op += mLen;
+		} else {
+			while (mLen-- > 0)
+				*op++ = *ref++;
+		}
+	}
+
+	return op == oend;
+}
@@ -0,0 +1,665 @@
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#include "../include/bitmap.h"
+#include "../include/defaults.h"
+#include "../include/journal.h"
+#include "../include/metadata.h"
+#include "../include/names.h"
+#include "../include/utils.h"
+
+extern int fs;
+
+/*
+ * Every piece of metadata lives at a fixed byte offset in the metadata region:
+ *
+ * 	[fs_settings][dir entries][name heap][FAT / extent records][free map]
+ * 	[block references][journal]
+ *
+ * Directory entries are fixed-width records, stored as they are held in
+ * memory, and refer to their names by offset into the name heap (see
+ * names.c); every region is therefore a plain copy of an in-memory array.
+ * From format version 2 on, each region starts on a block boundary. The
+ * block references are only there if files share blocks (see dedup.c).
+ *
+ * Before format version 3, every link was a size_t, and FAT entries also held
+ * their block's usage. Such images are read in and written back in their own
+ * layout, one record at a time, and are never paged.
+ *
+ * When paging is enabled, the regions are mapped privately rather than read
+ * in: the tables point straight into the mapping, the kernel reads pages in
+ * as they're first touched, and changes stay in memory until a checkpoint
+ * writes them to their home locations. Once more than the cap's worth of
+ * blocks has changed, the operation that crossed it checkpoints and drops
+ * every page, clean or not, to be read back in on demand.
+ *
+ * Mutators mark the bytes they touch
+ * as dirty; a checkpoint only renders and writes the metadata blocks holding
+ * those bytes. The block holding the settings is always rewritten, since the
+ * free block counter changes with nearly every write.
+ *
+ * Between checkpoints, the byte ranges marked by every `journal_batch()`
+ * operations are logged to the journal (see journal.c) as one transaction.
+ */
+
+typedef struct {
+	size_t off;
+	size_t len;
+} md_range;
+
+/* The records of images from before format version 3 */
+typedef struct {
+	_bool valid;
+	_bool isDir;
+	unsigned short nameLen;
+	uint32_t nameOff;
+	size_t size;
+	size_t parentIdx;
+	size_t firstBlockIdx;
+	size_t firstChild;
+	size_t nextSibling;
+	size_t prevSibling;
+} wide_dir_entry;
+
+typedef struct {
+	size_t used; /* never read back; written as 0 */
+	size_t next;
+} wide_fat_entry;
+
+typedef struct {
+	size_t start;
+	size_t len;
+	size_t next;
+} wide_extent;
+
+static struct {
+	struct fs_settings *fss;
+	const fs_table *dt;
+	const fs_table *fat;
+	size_t blockSize;
+	size_t nBlocks;	  /* number of metadata blocks, excluding the journal */
+	_bool wide;		  /* records are laid out as before version 3 */
+	size_t dirSize;	  /* bytes given to one directory entry */
+	size_t entrySize; /* bytes given to one FAT entry/extent record */
+	size_t dirOff;	  /* where the directory entries start */
+	size_t namesOff;  /* where the name heap starts */
+	size_t fatOff;	  /* where the FAT/extent table starts */
+	size_t mapOff;	  /* where the free map starts */
+	size_t refsOff;	  /* where the block references start, if any */
+	size_t end;		  /* first byte past the last region */
+	uint64_t *dirty;  /* one bit per metadata block */
+	size_t nDirty;	  /* bits set in `dirty` */
+	char *map;		  /* the private mapping of the regions, if paging */
+	size_t mapLen;
+
+	md_range *pend;	  /* ranges marked since the last journal commit */
+	size_t nPend;
+	size_t pendCap;
+	size_t pendBytes;
+	_bool overflow;	  /* more was marked than the journal can hold */
+	size_t depth;	  /* nesting of operations in progress */
+	size_t ops;		  /* operations finished since the last commit */
+} md = {.dirty = NULL, .map = NULL};
+
+static size_t pageCap = 0; /* bytes of changes held when paging; 0 if not */
+
+/**
+ * @brief remembers a marked range for the next journal commit, merging it with
+ * the previous one if they overlap, as consecutive marks often do
+ */
+static void add_pending(size_t off, size_t len) {
+	if (!journal_enabled() || md.overflow)
+		return;
+
+	md_range *last = md.nPend > 0 ? &md.pend[md.nPend - 1] : NULL;
+	if (last != NULL && off >= last->off && off <= last->off + last->len) {
+		size_t end = MAX(last->off + last->len, off + len);
+		md.pendBytes += end - (last->off + last->len);
+		last->len = end - last->off;
+	} else {
+		if (md.nPend == md.pendCap) {
+			size_t cap = MAX(16, md.pendCap * 2);
+			void *tmp  = realloc(md.pend, cap * sizeof(*md.pend));
+			if (tmp == NULL) {
+				perror("realloc() in add_pending()");
+				md.overflow = true;
+				return;
+			}
+			md.pend	   = tmp;
+			md.pendCap = cap;
+		}
+
+		md.pend[md.nPend++] = (md_range){.off = off, .len = len};
+		md.pendBytes += len;
+	}
+
+	/* too much to log; the next commit checkpoints instead */
+	if (md.pendBytes > journal_capacity())
+		md.overflow = true;
+}
+
+static void clear_pending(void) {
+	md.nPend = md.pendBytes = 0;
+	md.overflow				= false;
+}
+
+static void set_dirty(size_t k) {
+	if (!((md.dirty[k / 64] >> (k % 64)) & 1))
+		md.nDirty++;
+	md.dirty[k / 64] |= 1ull << (k % 64);
+}
+
+static void mark_range(size_t off, size_t len) {
+	if (md.dirty == NULL || len == 0)
+		return;
+
+	for (size_t k = off / md.blockSize; k <= (off + len - 1) / md.blockSize;
+		 k++)
+		set_dirty(k);
+
+	add_pending(off, len);
+}
+
+static size_t dir_record_size(const struct fs_settings *fss) {
+	return fss->version < 3 ? sizeof(wide_dir_entry) : sizeof(dir_entry);
+}
+
+static size_t fat_record_size(const struct fs_settings *fss) {
+	if (fss->version >= 3)
+		return fat_entry_size(fss);
+	return fss->allocMode == ALLOC_EXTENT ? sizeof(wide_extent)
+										  : sizeof(wide_fat_entry);
+}
+
+static size_t align(size_t off, const struct fs_settings *fss) {
+	if (fss->version < 2)
+		return off;
+	return (off + fss->blockSize - 1) / fss->blockSize * fss->blockSize;
+}
+
+/**
+ * @brief works out where each region of the metadata described by `fss` goes
+ *
+ * @return the first byte past the last region
+ */
+static size_t lay_out(const struct fs_settings *fss, size_t *dirOff,
+					  size_t *namesOff, size_t *fatOff, size_t *mapOff,
+					  size_t *refsOff) {
+	*dirOff	  = align(sizeof(struct fs_settings), fss);
+	*namesOff = align(*dirOff + dir_record_size(fss) * fss->entryCount, fss);
+	*fatOff	  = align(*namesOff + name_heap_size(fss->entryCount), fss);
+	*mapOff	  = align(*fatOff + fat_record_size(fss) * fss->numBlocks, fss);
+	*refsOff  = *mapOff + bitmap_words(fss->numBlocks) * sizeof(uint64_t);
+
+	if (fss->shareMode == SHARE_OFF)
+		return *refsOff;
+
+	*refsOff = align(*refsOff, fss);
+	return *refsOff + sizeof(block_ref) * fss->numBlocks;
+}
+
+/**
+ * @return the number of bytes the metadata described by `fss` takes up,
+ * excluding the journal
+ */
+size_t md_size(const struct fs_settings *fss) {
+	size_t dirOff, namesOff, fatOff, mapOff, refsOff;
+	return lay_out(fss, &dirOff, &namesOff, &fatOff, &mapOff, &refsOff);
+}
+
+/**
+ * @brief sets up the layout of the metadata region described by `fss`, whose
+ * contents are taken from `fss`, `dt` and `fat` whenever they are written
+ *
+ * @param allDirty whether every block should be written on the next
+ * checkpoint, e.g because the filesystem was just created
+ */
+_bool md_init(struct fs_settings *fss, const fs_table *dt, const fs_table *fat,
+			  _bool allDirty) {
+	md_destroy();
+
+	md.fss		 = fss;
+	md.dt		 = dt;
+	md.fat		 = fat;
+	md.nBlocks	 = fss->numMdBlocks - fss->jnlBlocks;
+	md.blockSize = fss->blockSize;
+	md.wide		 = fss->version < 3;
+	md.dirSize	 = dir_record_size(fss);
+	md.entrySize = fat_record_size(fss);
+	md.end		 = lay_out(fss, &md.dirOff, &md.namesOff, &md.fatOff,
+						   &md.mapOff, &md.refsOff);
+
+	if ((md.dirty = calloc(bitmap_words(md.nBlocks), sizeof(uint64_t))) ==
+		NULL) {
+		perror("calloc() in md_init()");
+		return false;
+	}
+
+	md.depth = md.ops = md.nDirty = 0;
+	clear_pending();
+
+	if (allDirty)
+		md_mark_all();
+
+	return true;
+}
+
+void md_destroy(void) {
+	if (md.map != NULL && munmap(md.map, md.mapLen) == -1)
+		perror("munmap() in md_destroy()");
+
+	free(md.dirty);
+	free(md.pend);
+	md.dirty   = NULL;
+	md.pend	   = NULL;
+	md.pendCap = 0;
+	md.map	   = NULL;
+}
+
+/**
+ * @brief makes the next mount page metadata in on demand, checkpointing once
+ * more than `cap` bytes of it have changed; 0 reads it all in up front
+ */
+void md_set_paging(size_t cap) { pageCap = cap; }
+
+/**
+ * @brief maps the metadata regions privately, if paging is enabled and the
+ * layout allows it
+ *
+ * @return NULL if the regions are to be read in instead
+ */
+char *md_map(void) {
+	/* the tables can only be used in place if they're aligned, and laid out
+	 * as they are in memory */
+	if (pageCap == 0 || md.wide)
+		return NULL;
+
+	md.mapLen = md.nBlocks * md.blockSize;
+	md.map = mmap(NULL, md.mapLen, PROT_READ | PROT_WRITE, MAP_PRIVATE, fs, 0);
+	if (md.map == MAP_FAILED) {
+		perror("mmap() in md_map()");
+		md.map = NULL;
+	}
+
+	return md.map;
+}
+
+/**
+ * @brief checkpoints, and lets go of every page of the mapping; they read
+ * back from the home locations just written
+ */
+static void drop_pages(void) {
+	if (md_checkpoint(md.fss, md.dt, md.fat) != 0 || md.nDirty > 0)
+		return;
+
+	if (madvise(md.map, md.mapLen, MADV_DONTNEED) == -1)
+		perror("madvise() in drop_pages()");
+}
+
+size_t md_dir_offset(size_t i) { return md.dirOff + i * md.dirSize; }
+size_t md_names_offset(void) { return md.namesOff; }
+size_t md_fat_offset(void) { return md.fatOff; }
+size_t md_map_offset(void) { return md.mapOff; }
+size_t md_refs_offset(void) { return md.refsOff; }
+
+void md_mark_all(void) { mark_range(0, md.end); }
+void md_mark_dir(size_t i) { mark_range(md_dir_offset(i), md.dirSize); }
+void md_mark_name(size_t off, size_t len) {
+	mark_range(md.namesOff + off, len);
+}
+
+void md_mark_fat(size_t i) {
+	mark_range(md.fatOff + i * md.entrySize, md.entrySize);
+}
+
+/**
+ * @brief marks the word of the free map holding block `b`'s bit
+ */
+void md_mark_map(size_t b) {
+	mark_range(md.mapOff + (b / 64) * sizeof(uint64_t), sizeof(uint64_t));
+}
+
+/**
+ * @brief marks the references of blocks [b, b + n)
+ */
+void md_mark_refs(size_t b, size_t n) {
+	mark_range(md.refsOff + b * sizeof(block_ref), n * sizeof(block_ref));
+}
+
+/**
+ * @brief copies the part of [off, off + len) that falls in the metadata block
+ * spanning [lo, lo + blockSize) into `out`
+ */
+static void copy_overlap(char *out, size_t lo, size_t off, const void *src,
+						 size_t len) {
+	size_t s = MAX(lo, off), e = MIN(lo + md.blockSize, off + len);
+	if (s < e)
+		memcpy(out + (s - lo), (const char *)src + (s - off), e - s);
+}
+
+static size_t widen(uint32_t x) { return x == NIL_IDX ? SIZE_MAX : x; }
+static uint32_t narrow(size_t x) { return x == SIZE_MAX ? NIL_IDX : x; }
+
+/**
+ * @brief works out which of `n` records of `size` bytes from `off` on fall in
+ * the metadata block spanning [lo, lo + blockSize)
+ */
+static void records_in(size_t lo, size_t off, size_t size, size_t n,
+					   size_t *from, size_t *to) {
+	*from = lo > off ? (lo - off) / size : 0;
+	*to	  = lo + md.blockSize > off
+				? MIN(n, (lo + md.blockSize - off + size - 1) / size)
+				: 0;
+}
+
+/**
+ * @brief renders the directory entries and FAT/extent records that fall in
+ * the block at `lo` in the layout of images before version 3
+ */
+static void render_wide(size_t lo, char *out) {
+	const fs_table *dt = md.dt, *fat = md.fat;
+	size_t from, to;
+
+	records_in(lo, md.dirOff, md.dirSize, dt->size, &from, &to);
+	for (size_t i = from; i < to; i++) {
+		const dir_entry *e = &dt->dirs[i];
+		wide_dir_entry w;
+		memset(&w, 0, sizeof(w));
+
+		w.valid			= e->valid;
+		w.isDir			= e->isDir;
+		w.nameLen		= e->nameLen;
+		w.nameOff		= e->nameOff;
+		w.size			= e->size;
+		w.parentIdx		= e->parentIdx;
+		w.firstBlockIdx = widen(e->firstBlockIdx);
+		w.firstChild	= widen(e->firstChild);
+		w.nextSibling	= widen(e->nextSibling);
+		w.prevSibling	= widen(e->prevSibling);
+		copy_overlap(out, lo, md_dir_offset(i), &w, sizeof(w));
+	}
+
+	records_in(lo, md.fatOff, md.entrySize, md.fss->numBlocks, &from, &to);
+	for (size_t i = from; i < to; i++) {
+		const size_t off = md.fatOff + i * md.entrySize;
+
+		if (md.fss->allocMode == ALLOC_EXTENT) {
+			const extent *r = &fat->runs[i];
+			wide_extent w	= {r->start, r->len, widen(r->next)};
+			copy_overlap(out, lo, off, &w, sizeof(w));
+		} else {
+			wide_fat_entry w = {0, widen(fat->blocks[i].next)};
+			copy_overlap(out, lo, off, &w, sizeof(w));
+		}
+	}
+}
+
+/**
+ * @brief produces the on-disk contents of the k'th metadata block from the
+ * in-memory structures
+ */
+static void render_block(size_t k, char *out) {
+	const fs_table *dt = md.dt, *fat = md.fat;
+	const size_t lo = k * md.blockSize;
+	memset(out, 0, md.blockSize);
+
+	struct fs_settings fss = *md.fss;
+	if (md.wide)
+		fss.freeExtPtr = widen(fss.freeExtPtr);
+	copy_overlap(out, lo, 0, &fss, sizeof(fss));
+
+	copy_overlap(out, lo, md.namesOff, dt->names->buf,
+				 dt->names->mapped ? dt->names->max : dt->names->len);
+	copy_overlap(out, lo, md.mapOff, fat->freeMap,
+				 bitmap_words(md.fss->numBlocks) * sizeof(uint64_t));
+	if (fat->refs != NULL)
+		copy_overlap(out, lo, md.refsOff, fat->refs, md.end - md.refsOff);
+
+	if (md.wide) {
+		render_wide(lo, out);
+		return;
+	}
+
+	copy_overlap(out, lo, md.dirOff, dt->dirs, dt->size * sizeof(dir_entry));
+	copy_overlap(out, lo, md.fatOff, fat->blocks,
+				 md.entrySize * md.fss->numBlocks);
+}
+
+/**
+ * @brief fills in the tables from `buf`, a copy of the home region, narrowing
+ * the records of images from before version 3
+ *
+ * @pre the settings and the tables' sizes are taken from `buf`, and the
+ * tables allocated
+ */
+void md_unpack(const char *buf, const fs_table *dt, const fs_table *fat) {
+	const struct fs_settings *fss = md.fss;
+
+	if (!md.wide) {
+		memcpy(dt->dirs, buf + md.dirOff, dt->size * sizeof(dir_entry));
+		memcpy(fat->blocks, buf + md.fatOff, md.entrySize * fss->numBlocks);
+		return;
+	}
+
+	md.fss->freeExtPtr = narrow(fss->freeExtPtr);
+
+	for (size_t i = 0; i < dt->size; i++) {
+		wide_dir_entry w;
+		memcpy(&w, buf + md_dir_offset(i), sizeof(w));
+
+		dt->dirs[i] = (dir_entry){.valid		 = w.valid,
+								  .isDir		 = w.isDir,
+								  .nameLen		 = w.nameLen,
+								  .nameOff		 = w.nameOff,
+								  .size			 = w.size,
+								  .parentIdx	 = w.parentIdx,
+								  .firstBlockIdx = narrow(w.firstBlockIdx),
+								  .firstChild	 = narrow(w.firstChild),
+								  .nextSibling	 = narrow(w.nextSibling),
+								  .prevSibling	 = narrow(w.prevSibling)};
+	}
+
+	for (size_t i = 0; i < fss->numBlocks; i++) {
+		const char *src = buf + md.fatOff + i * md.entrySize;
+
+		if (fss->allocMode == ALLOC_EXTENT) {
+			wide_extent w;
+			memcpy(&w, src, sizeof(w));
+			fat->runs[i] = (extent){w.start, w.len, narrow(w.next)};
+		} else {
+			wide_fat_entry w;
+			memcpy(&w, src, sizeof(w));
+			fat->blocks[i] = (fat_entry){narrow(w.next)};
+		}
+	}
+}
+
+/**
+ * @brief writes the dirty metadata blocks in [from, to)
+ */
+static int write_dirty(size_t from, size_t to) {
+	char buf[md.blockSize];
+
+	for (size_t k = from; k < to; k++) {
+		if (!((md.dirty[k / 64] >> (k % 64)) & 1))
+			continue;
+
+		render_block(k, buf);
+		if (write_block(k, md.blockSize, buf) != 0)
+			return -1;
+
+		md.dirty[k / 64] &= ~(1ull << (k % 64));
+		md.nDirty--;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief adds the current contents of [off, off + len) to the journal's
+ * pending transaction
+ */
+static int log_range(size_t off, size_t len) {
+	char buf[md.blockSize];
+
+	while (len > 0) {
+		size_t in = off % md.blockSize, n = MIN(len, md.blockSize - in);
+
+		render_block(off / md.blockSize, buf);
+		if (journal_append(off, buf + in, n) != 0)
+			return -1;
+
+		off += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief logs the settings and every range marked since the last commit
+ */
+static int log_pending(void) {
+	if (md.overflow || log_range(0, sizeof(struct fs_settings)) != 0)
+		return -1;
+
+	for (size_t r = 0; r < md.nPend; r++)
+		if (log_range(md.pend[r].off, md.pend[r].len) != 0)
+			return -1;
+
+	return 0;
+}
+
+/**
+ * @brief makes everything marked since the last commit durable through the
+ * journal, falling back to a checkpoint if it doesn't fit
+ *
+ * @return 0 on success, negative on failure
+ */
+int md_commit(void) {
+	if (md.dirty == NULL || !journal_enabled())
+		return 0;
+
+	md.ops = 0;
+	if (md.nPend == 0 && !md.overflow)
+		return 0;
+
+	if (log_pending() != 0) {
+		journal_discard();
+		return md_checkpoint(md.fss, md.dt, md.fat);
+	}
+
+	clear_pending();
+	return journal_commit();
+}
+
+/**
+ * @brief logs and commits every range marked since the last commit
+ *
+ * @return 0 on success, negative if it didn't fit in the journal, or
+ * couldn't be written
+ */
+static int commit_pending(void) {
+	if (log_pending() != 0 || journal_commit() != 0) {
+		journal_discard();
+		return -1;
+	}
+
+	clear_pending();
+	return 0;
+}
+
+/**
+ * @brief retires the transactions in the journal without the state that
+ * didn't fit behind them: they're written to their home locations and, once
+ * those are on disk, the settings on disk move on to a new generation, so
+ * they're never replayed over the newer blocks a checkpoint writes
+ *
+ * @return 0 on success, negative on failure
+ */
+static int retire_journal(void) {
+	const size_t seq = md.fss->jnlSeq + 1;
+	char buf[md.blockSize];
+
+	/* block 0 as folded, holding the settings as the journal left them */
+	if (journal_fold() != 0 || sync_fs() != 0 ||
+		read_block(0, md.blockSize, buf) != 0)
+		return -1;
+
+	memcpy(buf + offsetof(struct fs_settings, jnlSeq), &seq, sizeof(seq));
+	if (write_block(0, md.blockSize, buf) != 0 || sync_fs() != 0)
+		return -1;
+
+	md.fss->jnlSeq = seq;
+	journal_reset(seq);
+	return 0;
+}
+
+/**
+ * @brief writes every metadata block that changed since the last checkpoint
+ * to its home location and starts the journal over
+ *
+ * @details the state being checkpointed is committed to the journal first, so
+ * that a crash halfway through the home writes is replayed over. If it
+ * doesn't fit behind what the journal already holds, that is retired first
+ * and it's tried again in the empty journal; only a state too big for the
+ * whole journal is written unprotected. The settings block, which holds the
+ * journal's generation, goes last: once it is on disk, the journal is
+ * retired.
+ *
+ * @return 0 on success, negative on failure
+ */
+int md_checkpoint(struct fs_settings *fss, const fs_table *dt,
+				  const fs_table *fat) {
+	if (md.dirty == NULL)
+		return -1;
+
+	md.fss = fss;
+	md.dt  = dt;
+	md.fat = fat;
+
+	const _bool jnl = journal_enabled();
+	if (jnl) {
+		if ((md.nPend > 0 || md.overflow) && commit_pending() != 0) {
+			if (retire_journal() != 0)
+				return -2;
+			commit_pending();
+		}
+
+		clear_pending();
+		md.ops = 0;
+		md.fss->jnlSeq++;
+	}
+
+	if (write_dirty(1, md.nBlocks) != 0 || (jnl && sync_fs() != 0))
+		return -2;
+
+	set_dirty(0);
+	if (write_dirty(0, 1) != 0 || sync_fs() != 0)
+		return -3;
+
+	if (jnl)
+		journal_reset(md.fss->jnlSeq);
+
+	return 0;
+}
+
+/**
+ * @brief brackets an operation on the filesystem; operations may nest, and
+ * only the outermost one counts towards a group commit, so a transaction never
+ * holds half an operation
+ */
+void md_begin_op(void) { md.depth++; }
+
+void md_end_op(void) {
+	if (md.depth > 0)
+		md.depth--;
+
+	if (md.depth == 0 && journal_enabled() && ++md.ops >= journal_batch())
+		md_commit();
+
+	if (md.depth == 0 && md.map != NULL && md.nDirty * md.blockSize > pageCap)
+		drop_pages();
+}
@@ -0,0 +1,407 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/defaults.h"
+#include "../include/metadata.h"
+#include "../include/names.h"
+#include "../include/utils.h"
+
+/*
+ * Names live in one heap, NUL-terminated, and directory entries refer to them
+ * by offset; the heap is kept byte for byte as it is laid out on disk, so
+ * mounting copies it in one go, and tearing it down takes a handful of frees.
+ *
+ * The span a name leaves behind when its entry is renamed or removed goes on
+ * a free list by its size. A new name takes a span of exactly its size if
+ * there is one, or else carves itself out of the smallest larger one, whose
+ * remainder goes back on the lists; only then is the heap appended to. The
+ * lists are not persisted: whatever was free when the image was last closed
+ * is reclaimed once the heap is full, by packing the live names together. The
+ * region on disk has room for one more name of MAX_NAME_LEN than there are
+ * entries, so that always makes room.
+ *
+ * From format version 4 on, the content of a small file is kept right behind
+ * its name, in the same span (see write_at()), as long as the two fit in the
+ * MAX_NAME_LEN + 1 bytes a name may take; every span stays within that, so
+ * the guarantee above holds.
+ *
+ * When the directory table is paged in, the heap is the mapped region itself,
+ * and where the names in use end is only worked out once one is first stored
+ * or dropped, so that mounting reads none of the entries.
+ */
+
+#define NAME_HEAP_MIN 4096				 /* bytes first allocated for names */
+#define NAME_SPANS	  (MAX_NAME_LEN + 2) /* free lists; indexed by span size */
+#define SPAN_WORDS	  ((NAME_SPANS + 63) / 64)
+#define LEN_UNKNOWN	  SIZE_MAX
+
+/* The free spans of one size */
+typedef struct {
+	uint32_t *offs;
+	size_t n;
+	size_t cap;
+} span_list;
+
+struct name_spans {
+	span_list lists[NAME_SPANS];
+	uint64_t nonEmpty[SPAN_WORDS]; /* one bit per list */
+};
+
+/**
+ * @return the number of bytes the name heap takes up on disk
+ */
+size_t name_heap_size(size_t entryCount) {
+	return (entryCount + 1) * (MAX_NAME_LEN + 1);
+}
+
+/**
+ * @return the number of bytes of the heap `e` takes up: its name, and the
+ * content of a file kept inline
+ */
+static size_t span_len(const dir_entry *e) {
+	return e->nameLen + 1u + (entry_is_inline(e) ? e->size : 0);
+}
+
+static _bool grow(name_heap *x, size_t need) {
+	size_t cap = MIN(x->max, MAX(need, x->cap * 2));
+	char *tmp  = realloc(x->buf, cap);
+	if (tmp == NULL) {
+		perror("realloc() in grow()");
+		return false;
+	}
+
+	x->buf = tmp;
+	x->cap = cap;
+	return true;
+}
+
+/**
+ * @brief makes the `len` bytes at `off` available to later names. Spans that
+ * can't be recorded are simply left for the next compaction.
+ */
+static void release(name_heap *x, size_t off, size_t len) {
+	/* the last span just shortens the heap */
+	if (off + len == x->len) {
+		x->len = off;
+		return;
+	}
+
+	span_list *l = &x->spans->lists[len];
+	if (l->n == l->cap) {
+		size_t cap = MAX(16, l->cap * 2);
+		void *tmp  = realloc(l->offs, cap * sizeof(*l->offs));
+		if (tmp == NULL)
+			return;
+		l->offs = tmp;
+		l->cap	= cap;
+	}
+
+	l->offs[l->n++] = off;
+	x->spans->nonEmpty[len / 64] |= 1ull << (len % 64);
+}
+
+/**
+ * @brief takes a span of `len` bytes off the free lists, splitting a larger
+ * one if need be
+ *
+ * @return its offset; SIZE_MAX if there is none
+ */
+static size_t reuse(name_heap *x, size_t len) {
+	struct name_spans *s = x->spans;
+
+	for (size_t w = len / 64; w < SPAN_WORDS; w++) {
+		uint64_t bits = s->nonEmpty[w];
+		if (w == len / 64)
+			bits &= ~0ull << (len % 64);
+		if (bits == 0)
+			continue;
+
+		size_t have	 = w * 64 + __builtin_ctzll(bits);
+		span_list *l = &s->lists[have];
+		size_t off	 = l->offs[--l->n];
+		if (l->n == 0)
+			s->nonEmpty[have / 64] &= ~(1ull << (have % 64));
+
+		if (have > len)
+			release(x, off + len, have - len);
+		return off;
+	}
+
+	return SIZE_MAX;
+}
+
+/**
+ * @return where the names in use end, going by the valid entries of `dt`
+ */
+static size_t names_end(const fs_table *dt) {
+	size_t len = 0;
+	for (size_t i = 0; i < dt->size; i++)
+		if (dt->dirs[i].valid)
+			len = MAX(len, dt->dirs[i].nameOff + span_len(&dt->dirs[i]));
+	return len;
+}
+
+/**
+ * @brief works out the heap's length, if it's paged in and hasn't been yet
+ */
+static void settle(const fs_table *dt) {
+	if (dt->names->len == LEN_UNKNOWN)
+		dt->names->len = MIN(names_end(dt), dt->names->max);
+}
+
+/**
+ * @brief packs the names, and inline content, of every valid entry together
+ * at the start of the heap, which leaves nothing on the free lists
+ */
+static _bool compact(const fs_table *dt) {
+	name_heap *x = dt->names;
+	char *buf	 = malloc(x->cap);
+	if (buf == NULL) {
+		perror("malloc() in compact()");
+		return false;
+	}
+
+	size_t len = 0;
+	for (size_t i = 0; i < dt->size; i++) {
+		dir_entry *e = &dt->dirs[i];
+		if (!e->valid || e->nameLen == 0)
+			continue;
+
+		memcpy(buf + len, x->buf + e->nameOff, span_len(e));
+		e->nameOff = len;
+		len += span_len(e);
+		md_mark_dir(i);
+	}
+
+	/* a mapped heap has to stay where it is */
+	if (x->mapped) {
+		memcpy(x->buf, buf, len);
+		free(buf);
+	} else {
+		free(x->buf);
+		x->buf = buf;
+	}
+
+	x->len = len;
+	md_mark_name(0, len);
+
+	for (size_t k = 0; k < NAME_SPANS; k++)
+		x->spans->lists[k].n = 0;
+	memset(x->spans->nonEmpty, 0, sizeof(x->spans->nonEmpty));
+	return true;
+}
+
+/**
+ * @brief sets up the directory table's name heap from `src`, the heap region
+ * of the image, or an empty one if `src` is NULL. If the table is mapped, the
+ * heap is `src` itself.
+ *
+ * @pre the entries in `dt` are loaded
+ */
+_bool init_name_heap(fs_table *dt, char *src) {
+	name_heap *x = malloc(sizeof(*x));
+	if (x == NULL) {
+		perror("malloc() in init_name_heap()");
+		return false;
+	}
+
+	x->max	  = name_heap_size(dt->size);
+	x->mapped = dt->mapped && src != NULL;
+
+	if (x->mapped) {
+		x->buf	 = src;
+		x->cap	 = x->max;
+		x->len	 = LEN_UNKNOWN;
+		x->spans = calloc(1, sizeof(*x->spans));
+		if (x->spans == NULL) {
+			perror("calloc() in init_name_heap()");
+			free(x);
+			return false;
+		}
+
+		dt->names = x;
+		return true;
+	}
+
+	/* the names in use end where the last one does */
+	x->len = src != NULL ? names_end(dt) : 0;
+
+	if (x->len > x->max) {
+		fprintf(stderr, "init_name_heap(): name heap is corrupt\n");
+		free(x);
+		return false;
+	}
+
+	x->cap	 = MIN(x->max, MAX(x->len, NAME_HEAP_MIN));
+	x->buf	 = malloc(x->cap);
+	x->spans = calloc(1, sizeof(*x->spans));
+	if (x->buf == NULL || x->spans == NULL) {
+		perror("malloc() in init_name_heap()");
+		free(x->buf);
+		free(x->spans);
+		free(x);
+		return false;
+	}
+
+	if (src != NULL)
+		memcpy(x->buf, src, x->len);
+
+	dt->names = x;
+	return true;
+}
+
+void free_name_heap(fs_table *dt) {
+	if (dt->names == NULL)
+		return;
+
+	for (size_t k = 0; k < NAME_SPANS; k++)
+		free(dt->names->spans->lists[k].offs);
+	free(dt->names->spans);
+	if (!dt->names->mapped)
+		free(dt->names->buf);
+	free(dt->names);
+	dt->names = NULL;
+}
+
+/**
+ * @return the NUL-terminated name of `e`, an entry of `dt`; valid until the
+ * next name is stored
+ */
+const char *entry_name(const fs_table *dt, const dir_entry *e) {
+	return e->nameLen == 0 ? "" : dt->names->buf + e->nameOff;
+}
+
+/**
+ * @return where the content of `e`, a file kept inline, starts
+ */
+char *inline_data(const fs_table *dt, const dir_entry *e) {
+	return dt->names->buf + e->nameOff + e->nameLen + 1;
+}
+
+/**
+ * @return true if `e` is a file whose content, if any, is kept in the name
+ * heap rather than in blocks
+ */
+_bool entry_is_inline(const dir_entry *e) {
+	return !e->isDir && e->firstBlockIdx == NIL_IDX;
+}
+
+/**
+ * @brief hands the span holding entry `i`'s name back for reuse, leaving the
+ * entry nameless
+ */
+void drop_name(size_t i, const fs_table *dt) {
+	dir_entry *e = &dt->dirs[i];
+	if (e->nameLen == 0)
+		return;
+
+	settle(dt);
+	release(dt->names, e->nameOff, span_len(e));
+	e->nameLen = 0;
+}
+
+/**
+ * @brief works out the heap's length now, if it's still unknown; needed
+ * before an inline entry's content moves to blocks, after which its span no
+ * longer counts it
+ */
+void settle_name_heap(const fs_table *dt) { settle(dt); }
+
+/**
+ * @brief hands back the `len` bytes of content entry `i` kept after its name,
+ * once that content has moved to blocks of the file's own
+ *
+ * @pre the entry is no longer inline, and the heap was settled while it was
+ */
+void drop_inline(size_t i, size_t len, const fs_table *dt) {
+	const dir_entry *e = &dt->dirs[i];
+	if (len == 0)
+		return;
+
+	settle(dt);
+	release(dt->names, e->nameOff + e->nameLen + 1u, len);
+}
+
+/**
+ * @brief moves entry `i` to a span of its own holding `name`, NUL-terminated,
+ * followed by `len` bytes of `data`
+ *
+ * @pre nameLen + len <= MAX_NAME_LEN
+ */
+static _bool place(size_t i, const char *name, unsigned short nameLen,
+				   const char *data, size_t len, const fs_table *dt) {
+	name_heap *x	  = dt->names;
+	const size_t need = nameLen + 1 + len;
+
+	/* either may itself live in the heap, which can move */
+	char copy[MAX_NAME_LEN + 1];
+	memcpy(copy, name, nameLen);
+	copy[nameLen] = '\0';
+	if (len > 0)
+		memcpy(copy + nameLen + 1, data, len);
+
+	settle(dt);
+	size_t off = reuse(x, need);
+	if (off == SIZE_MAX) {
+		if (x->len + need > x->max && !compact(dt))
+			return false;
+
+		if (x->len + need > x->cap && !grow(x, x->len + need))
+			return false;
+
+		off = x->len;
+		x->len += need;
+	}
+
+	memcpy(x->buf + off, copy, need);
+	md_mark_name(off, need);
+
+	drop_name(i, dt);
+	dt->dirs[i].nameOff = off;
+	dt->dirs[i].nameLen = nameLen;
+	md_mark_dir(i);
+	return true;
+}
+
+/**
+ * @brief gives entry `i` the name `name`, of `nameLen` bytes, in place of the
+ * one it held, if any; inline content moves along with it
+ *
+ * @pre nameLen, plus the size of any inline content, is at most MAX_NAME_LEN
+ */
+_bool store_name(size_t i, const char *name, unsigned short nameLen,
+				 const fs_table *dt) {
+	const dir_entry *e = &dt->dirs[i];
+	const _bool held   = entry_is_inline(e) && e->nameLen > 0;
+
+	return place(i, name, nameLen, held ? inline_data(dt, e) : NULL,
+				 held ? e->size : 0, dt);
+}
+
+/**
+ * @brief makes `len` bytes of `data` the content of entry `i`, a file kept
+ * inline, and sets its size to match. Shrinking happens in place.
+ *
+ * @pre the entry's nameLen + len <= MAX_NAME_LEN
+ */
+_bool store_inline(size_t i, const char *data, size_t len,
+				   const fs_table *dt) {
+	dir_entry *e	  = &dt->dirs[i];
+	const size_t have = span_len(e), need = e->nameLen + 1 + len;
+
+	if (need <= have) {
+		settle(dt);
+		if (len > 0) {
+			memmove(inline_data(dt, e), data, len);
+			md_mark_name(e->nameOff + e->nameLen + 1, len);
+		}
+		if (need < have)
+			release(dt->names, e->nameOff + need, have - need);
+	} else if (!place(i, entry_name(dt, e), e->nameLen, data, len, dt)) {
+		return false;
+	}
+
+	e->size = len;
+	md_mark_dir(i);
+	return true;
+}
@@ -0,0 +1,209 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/aio.h"
+#include "../include/defaults.h"
+#include "../include/readahead.h"
+#include "../include/utils.h"
+
+/*
+ * Each file remembers where its last read ended. A read that starts right
+ * there is taken to be part of a forward scan, and the blocks past it are
+ * fetched ahead of time through the async engine into one of two windows:
+ * the one the reader is in, and the one after it, which is read while the
+ * reader is still busy with the first. Once the reader moves into the second,
+ * the two swap roles and the one left behind is sent further ahead. A window
+ * starts out RA_MIN blocks (or as many as the read took) long, and doubles
+ * with every read the scan makes, up to RA_MAX bytes; a read anywhere else
+ * leaves the windows be, but starts that over.
+ *
+ * Windows hold whole blocks, in file order, and are only ever read; they are
+ * dropped once a scan reaches the end of the file, and whenever the file's
+ * blocks change (see write_at() and drop_block_map()). Reads of RA_MAX bytes
+ * or more are big enough to keep the disk busy by themselves, and mapped
+ * filesystems are left to the kernel's own readahead.
+ */
+
+typedef struct {
+	size_t first; /* file block the window starts at */
+	size_t n;	  /* blocks in the window; 0 if it holds none */
+	size_t cap;	  /* blocks `buf` has room for */
+	char *buf;
+	aio_batch batch;
+	_bool busy; /* reads may still be in flight */
+} window;
+
+struct readahead {
+	size_t pos;		/* where the file's last read ended */
+	size_t win;		/* blocks the next window is given; 0 outside a scan */
+	window *w[2];	/* allocated on first use */
+	int cur;		/* w[cur] is the window the reader is in */
+};
+
+static _bool holds(const window *w, size_t k) {
+	return w != NULL && w->n > 0 && k >= w->first && k - w->first < w->n;
+}
+
+/**
+ * @brief waits for a window's reads; one that failed is emptied
+ *
+ * @return true if the window holds any blocks
+ */
+static _bool settle(window *w) {
+	if (w->busy) {
+		w->busy = false;
+		if (aio_wait(&w->batch) != 0) {
+			/* a batch keeps its first failure; start afresh */
+			aio_batch_destroy(&w->batch);
+			aio_batch_init(&w->batch, w->batch.blockSize);
+			w->n = 0;
+		}
+	}
+
+	return w->n > 0;
+}
+
+static void release(window *w) {
+	if (w == NULL)
+		return;
+
+	settle(w);
+	aio_batch_destroy(&w->batch);
+	free(w->buf);
+	free(w);
+}
+
+/**
+ * @brief points the window at `n` blocks of the file from `first` onwards,
+ * and starts reading them in, a run of physically adjacent blocks at a time
+ */
+static void start(window **slot, const file_state *f, size_t first, size_t n,
+				  size_t bs) {
+	window *w = *slot;
+	if (w == NULL) {
+		if ((w = calloc(1, sizeof(*w))) == NULL) {
+			perror("calloc() in start()");
+			return;
+		}
+		aio_batch_init(&w->batch, bs);
+		*slot = w;
+	}
+
+	settle(w);
+	w->n = 0;
+	n	 = MIN(n, f->mapLen - first);
+
+	if (n > w->cap) {
+		char *tmp = realloc(w->buf, n * bs);
+		if (tmp == NULL) {
+			perror("realloc() in start()");
+			return;
+		}
+		w->buf = tmp;
+		w->cap = n;
+	}
+
+	const size_t *map = f->blockMap + first;
+	w->first		  = first;
+	w->busy			  = true;
+	for (size_t k = 0, run; k < n; k += run) {
+		for (run = 1; k + run < n && map[k + run] == map[k] + run;)
+			run++;
+		if (aio_read(&w->batch, map[k], run, w->buf + k * bs) != 0)
+			break;
+		w->n = k + run;
+	}
+	aio_flush(&w->batch);
+}
+
+/**
+ * @brief copies as much of the read as the file's windows hold, from its
+ * start on, waiting for their blocks if need be
+ *
+ * @return the number of bytes served; the rest must come from the disk
+ */
+size_t readahead_serve(file_state *f, size_t fPos, size_t size,
+					   size_t blockSize, char *buf) {
+	struct readahead *ra = f->ra;
+	size_t done			 = 0;
+
+	while (ra != NULL && done < size) {
+		const size_t pos = fPos + done, k = pos / blockSize;
+		window *w = holds(ra->w[0], k)	 ? ra->w[0]
+					: holds(ra->w[1], k) ? ra->w[1]
+										 : NULL;
+		if (w == NULL || !settle(w) || !holds(w, k))
+			break;
+
+		const size_t off = pos - w->first * blockSize;
+		const size_t n	 = MIN(size - done, w->n * blockSize - off);
+		memcpy(buf + done, w->buf + off, n);
+		done += n;
+	}
+
+	return done;
+}
+
+/**
+ * @brief notes a read of the file, and if it carries on a forward scan, makes
+ * sure the blocks after it are on their way in
+ *
+ * @pre the file's block map is built
+ */
+void readahead_advance(file_state *f, size_t fPos, size_t size,
+					   size_t blockSize) {
+	const size_t next = (fPos + size) / blockSize; /* holds the next byte */
+
+	if (next >= f->mapLen || size >= RA_MAX ||
+		block_ptr(f->blockMap[next], blockSize) != NULL) {
+		readahead_drop(f);
+		return;
+	}
+
+	if (f->ra == NULL && (f->ra = calloc(1, sizeof(*f->ra))) == NULL) {
+		perror("calloc() in readahead_advance()");
+		return;
+	}
+
+	struct readahead *ra = f->ra;
+	const _bool scan	 = fPos == ra->pos;
+	ra->pos				 = fPos + size;
+	if (!scan) {
+		ra->win = 0;
+		return;
+	}
+
+	const size_t most = MAX(RA_MIN, RA_MAX / blockSize);
+	const size_t took = (size + blockSize - 1) / blockSize;
+	ra->win = ra->win == 0 ? MAX(RA_MIN, took) : ra->win * 2;
+	ra->win = MIN(ra->win, most);
+
+	if (!holds(ra->w[ra->cur], next)) {
+		if (holds(ra->w[!ra->cur], next))
+			ra->cur = !ra->cur;
+		else
+			start(&ra->w[ra->cur], f, next, ra->win, blockSize);
+	}
+
+	const window *cur = ra->w[ra->cur], *ahead = ra->w[!ra->cur];
+	if (!holds(cur, next))
+		return;
+
+	const size_t end = cur->first + cur->n;
+	if (end < f->mapLen && !holds(ahead, end))
+		start(&ra->w[!ra->cur], f, end, ra->win, blockSize);
+}
+
+/**
+ * @brief forgets the file's scan, once any reads still in flight for it are
+ * done
+ */
+void readahead_drop(file_state *f) {
+	if (f->ra == NULL)
+		return;
+
+	release(f->ra->w[0]);
+	release(f->ra->w[1]);
+	free(f->ra);
+	f->ra = NULL;
+}
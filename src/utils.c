@@ -1,11 +1,21 @@
+#define _GNU_SOURCE /* fallocate() */
+
 #include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
+#include "../include/cache.h"
 #include "../include/utils.h"
 
-extern FILE *fs;
+extern int fs;
+
+static char *fsMap	  = NULL; /* `fs` mapped into memory, if in mmap mode */
+static size_t fsMapLen = 0;
+static _bool punchHoles = false; /* see punch_blocks() */
 
 /**
  * @details if adding `add` bytes to `buf`, (whose maximum capacity is
@@ -48,39 +58,291 @@ char *copy_string(const char *str) {
 	return copy;
 }
 
-int read_block(size_t blockNo, size_t blockSize, char *buf) {
-	/* goto requested fpos */
-	if (fseek(fs, blockSize * blockNo, SEEK_SET) == -1) {
-		perror("fseek() in read_block()");
+/**
+ * @brief grows the (empty) filesystem file to `len` bytes without writing
+ * them: the file is left sparse, or has all of its space reserved if
+ * `prealloc` is set. Either way, every byte reads back as 0.
+ */
+_bool size_fs(size_t len, _bool prealloc) {
+	int err;
+
+	if (prealloc) {
+		/* returns the error instead of setting errno */
+		if ((err = posix_fallocate(fs, 0, len)) != 0) {
+			fprintf(stderr, "posix_fallocate() in size_fs(): %s\n",
+					strerror(err));
+			return false;
+		}
+		return true;
+	}
+
+	if (ftruncate(fs, len) == -1) {
+		perror("ftruncate() in size_fs()");
+		return false;
+	}
+
+	return true;
+}
+
+void set_hole_punching(_bool enabled) { punchHoles = enabled; }
+
+/**
+ * @brief hands the space of `n` blocks starting at `blockNo` back to the
+ * host filesystem, if hole punching is enabled; the blocks read back as 0
+ * afterwards. Cached copies are dropped so they aren't written back over the
+ * hole.
+ */
+void punch_blocks(size_t blockNo, size_t n, size_t blockSize) {
+	if (!punchHoles || n == 0)
+		return;
+
+	for (size_t j = 0; j < n; j++)
+		cache_discard(blockNo + j);
+
+	if (fallocate(fs, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+				  blockNo * blockSize, n * blockSize) == -1) {
+		/* e.g the host filesystem doesn't support it; don't try again */
+		perror("fallocate() in punch_blocks()");
+		punchHoles = false;
+	}
+}
+
+/**
+ * @brief maps the first `len` bytes of the filesystem into memory; from then
+ * on, block reads and writes are plain copies to/from the mapping
+ */
+_bool map_fs(size_t len) {
+	void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fs, 0);
+	if (m == MAP_FAILED) {
+		perror("mmap() in map_fs()");
+		return false;
+	}
+
+	fsMap	 = m;
+	fsMapLen = len;
+	return true;
+}
+
+void unmap_fs(void) {
+	if (fsMap == NULL)
+		return;
+
+	if (munmap(fsMap, fsMapLen) == -1)
+		perror("munmap() in unmap_fs()");
+
+	fsMap	 = NULL;
+	fsMapLen = 0;
+}
+
+/**
+ * @return a pointer to the block inside the mapping, or NULL if the
+ * filesystem isn't mapped (or the block lies beyond it)
+ */
+char *block_ptr(size_t blockNo, size_t blockSize) {
+	if (fsMap == NULL || (blockNo + 1) * blockSize > fsMapLen)
+		return NULL;
+	return fsMap + blockNo * blockSize;
+}
+
+/**
+ * @brief pushes everything written so far down to the disk: dirty cached
+ * blocks are written back, the mapping, if any, is msync'd and the file is
+ * fdatasync'd
+ */
+int sync_fs(void) {
+	if (cache_flush() != 0)
 		return -1;
+
+	if (fsMap != NULL && msync(fsMap, fsMapLen, MS_SYNC) == -1) {
+		perror("msync() in sync_fs()");
+		return -2;
 	}
 
-	/* read chunk */
-	if (fread(buf, 1, blockSize, fs) != blockSize) {
-		if (feof(fs)) {
-			fprintf(stderr, "fread() in read_block - EOF occurred\n");
-			return -2;
-		} else if (ferror(fs)) {
-			perror("fread() in read_block()");
-			return -3;
-		}
+	if (fdatasync(fs) == -1) {
+		perror("fdatasync() in sync_fs()");
+		return -3;
 	}
 
 	return 0;
 }
 
+/**
+ * @brief reads a block, going through the mapping or the block cache if
+ * either is set up
+ */
+int read_block(size_t blockNo, size_t blockSize, char *buf) {
+	const char *src = block_ptr(blockNo, blockSize);
+	if (src != NULL) {
+		memcpy(buf, src, blockSize);
+		return 0;
+	}
+
+	if (cache_enabled())
+		return cache_read(blockNo, buf);
+	return dev_read_block(blockNo, blockSize, buf);
+}
+
+/**
+ * @brief writes a block, going through the mapping or the block cache if
+ * either is set up. In those cases the block reaches disk on msync(),
+ * eviction, or at sync_fs().
+ */
 int write_block(size_t blockNo, size_t blockSize, const char *buf) {
-	/* goto requested fpos */
-	if (fseek(fs, blockSize * blockNo, SEEK_SET) == -1) {
-		perror("fseek() in write_block()");
-		return -1;
+	char *dst = block_ptr(blockNo, blockSize);
+	if (dst != NULL) {
+		memcpy(dst, buf, blockSize);
+		return 0;
 	}
 
-	/* write chunk */
-	if (fwrite(buf, 1, blockSize, fs) < blockSize) {
-		if (ferror(fs))
-			perror("fwrite() in write_block()");
-		return -2;
+	if (cache_enabled())
+		return cache_write(blockNo, buf);
+	return dev_write_block(blockNo, blockSize, buf);
+}
+
+/**
+ * @brief reads `n` consecutive blocks with a single request. Blocks that are
+ * mapped or sitting in the cache are taken from there, so the result is the
+ * same as `n` calls to read_block(), minus the per-block overhead.
+ */
+int read_blocks(size_t blockNo, size_t n, size_t blockSize, char *buf) {
+	if (n == 1 && block_ptr(blockNo, blockSize) == NULL)
+		return read_block(blockNo, blockSize, buf);
+
+	struct iovec iov = {.iov_base = buf, .iov_len = n * blockSize};
+	return read_blocksv(blockNo, n, blockSize, &iov, 1);
+}
+
+/**
+ * @brief read_blocks(), scattered over `iovcnt` buffers that each take a
+ * whole number of blocks
+ */
+int read_blocksv(size_t blockNo, size_t n, size_t blockSize,
+				 const struct iovec *iov, int iovcnt) {
+	const char *src = block_ptr(blockNo + n - 1, blockSize);
+	if (src != NULL) {
+		src = block_ptr(blockNo, blockSize);
+		for (int v = 0; v < iovcnt; src += iov[v++].iov_len)
+			memcpy(iov[v].iov_base, src, iov[v].iov_len);
+		return 0;
+	}
+
+	int ret;
+	if ((ret = dev_read_blocksv(blockNo, blockSize, iov, iovcnt)) != 0)
+		return ret;
+
+	peek_cached(blockNo, blockSize, iov, iovcnt);
+	return 0;
+}
+
+/**
+ * @brief overwrites blocks just read from disk around the cache with the
+ * cached copies of them, which may not have been written back yet
+ */
+void peek_cached(size_t blockNo, size_t blockSize, const struct iovec *iov,
+				 int iovcnt) {
+	if (!cache_enabled())
+		return;
+
+	for (int v = 0; v < iovcnt; v++)
+		for (size_t off = 0; off < iov[v].iov_len; off += blockSize)
+			cache_peek(blockNo++, (char *)iov[v].iov_base + off);
+}
+
+/**
+ * @brief writes `n` consecutive blocks with a single request, going around
+ * the block cache; copies of those blocks the cache holds are refreshed, so
+ * the result is the same as `n` calls to write_block()
+ */
+int write_blocks(size_t blockNo, size_t n, size_t blockSize, const char *buf) {
+	char *dst = block_ptr(blockNo + n - 1, blockSize);
+	if (dst != NULL) {
+		memcpy(block_ptr(blockNo, blockSize), buf, n * blockSize);
+		return 0;
+	}
+
+	if (n == 1)
+		return write_block(blockNo, blockSize, buf);
+
+	int ret;
+	if ((ret = dev_write_blocks(blockNo, n, blockSize, buf)) != 0)
+		return ret;
+
+	if (cache_enabled())
+		for (size_t j = 0; j < n; j++)
+			cache_refresh(blockNo + j, buf + j * blockSize);
+
+	return 0;
+}
+
+int dev_read_block(size_t blockNo, size_t blockSize, char *buf) {
+	return dev_read_blocks(blockNo, 1, blockSize, buf);
+}
+
+int dev_read_blocks(size_t blockNo, size_t n, size_t blockSize, char *buf) {
+	struct iovec iov = {.iov_base = buf, .iov_len = n * blockSize};
+	return dev_read_blocksv(blockNo, blockSize, &iov, 1);
+}
+
+/**
+ * @brief reads consecutive blocks starting at `blockNo` straight into
+ * `iovcnt` buffers with preadv()
+ *
+ * @details positional, so threads reading different blocks never contend over
+ * a shared file offset
+ */
+int dev_read_blocksv(size_t blockNo, size_t blockSize, const struct iovec *iov,
+					 int iovcnt) {
+	struct iovec v[iovcnt];
+	off_t pos = blockNo * blockSize;
+	ssize_t r;
+	int first = 0;
+
+	memcpy(v, iov, sizeof(v));
+
+	while (first < iovcnt) {
+		if ((r = preadv(fs, v + first, iovcnt - first, pos)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("preadv() in dev_read_blocksv()");
+			return -3;
+		}
+
+		if (r == 0) {
+			fprintf(stderr, "preadv() in dev_read_blocksv - EOF occurred\n");
+			return -2;
+		}
+
+		/* short read; carry on from where it stopped */
+		for (pos += r; first < iovcnt && (size_t)r >= v[first].iov_len;)
+			r -= v[first++].iov_len;
+		if (first < iovcnt) {
+			v[first].iov_base = (char *)v[first].iov_base + r;
+			v[first].iov_len -= r;
+		}
+	}
+
+	return 0;
+}
+
+int dev_write_block(size_t blockNo, size_t blockSize, const char *buf) {
+	return dev_write_blocks(blockNo, 1, blockSize, buf);
+}
+
+int dev_write_blocks(size_t blockNo, size_t n, size_t blockSize,
+					 const char *buf) {
+	size_t done = 0, len = n * blockSize;
+	off_t pos	= blockNo * blockSize;
+	ssize_t w;
+
+	while (done < len) {
+		if ((w = pwrite(fs, buf + done, len - done, pos + done)) == -1) {
+			if (errno == EINTR)
+				continue;
+			perror("pwrite() in dev_write_blocks()");
+			return -2;
+		}
+
+		done += w;
 	}
 
 	return 0;
@@ -0,0 +1,350 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "../include/aio.h"
+#include "../include/bitmap.h"
+#include "../include/extent.h"
+#include "../include/lz.h"
+#include "../include/metadata.h"
+#include "../include/utils.h"
+#include "../include/zcluster.h"
+
+/*
+ * In a compressed filesystem, a file's content is cut into clusters of
+ * ZCLUSTER_BLOCKS blocks' worth of bytes (the last one may be shorter), each
+ * compressed on its own, so any part of a file can be read or rewritten
+ * without touching the rest of it. A cluster is stored in a run of blocks of
+ * its own, described by one extent record; the file's block map holds these
+ * records, in file order.
+ *
+ * A cluster is only kept compressed if that saves it at least one block. So
+ * whether it is follows from its record: if the run is exactly as long as
+ * the cluster's bytes need, they're stored as they are; if it's shorter, the
+ * run holds the compressed bytes, behind a header with their length.
+ *
+ * A cluster that is rewritten and still takes as many blocks, for as many
+ * bytes, is overwritten in place; otherwise it's written out to a new run,
+ * near the old one, which is then freed. Either way, a run is never left
+ * holding a cluster in a form its record doesn't describe.
+ */
+
+typedef uint32_t zheader; /* bytes of compressed data that follow */
+
+static size_t blocks_for(size_t bytes, size_t bs) {
+	return (bytes + bs - 1) / bs;
+}
+
+/**
+ * @return the number of bytes of a file's `j`'th cluster, given its size
+ */
+static size_t cluster_bytes(size_t j, size_t size, size_t cb) {
+	return size > j * cb ? MIN(cb, size - j * cb) : 0;
+}
+
+/**
+ * @brief decompresses a cluster holding `bytes` bytes, from the blocks of its
+ * run in `z`, into `raw`
+ *
+ * @return 0 on success, negative if the cluster is damaged
+ */
+static int unpack(const extent *r, const char *z, size_t bytes, size_t bs,
+				  char *raw) {
+	zheader zLen;
+	memcpy(&zLen, z, sizeof(zLen));
+	if (zLen > r->len * bs - sizeof(zLen) ||
+		!lz_decompress(z + sizeof(zLen), zLen, raw, bytes)) {
+		fprintf(stderr, "unpack(): damaged cluster at block %u\n", r->start);
+		return -3;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief reads a cluster holding `bytes` bytes into `raw`, decompressing it
+ * if need be
+ *
+ * @param z room for the cluster's blocks as they are on disk
+ *
+ * @return 0 on success, negative on failure
+ */
+static int load_cluster(const extent *r, size_t bytes, size_t bs, char *raw,
+						char *z) {
+	const size_t lb = blocks_for(bytes, bs);
+	if (r->len == lb)
+		return read_blocks(r->start, lb, bs, raw) == 0 ? 0 : -3;
+
+	if (r->len > lb || read_blocks(r->start, r->len, bs, z) != 0)
+		return -3;
+	return unpack(r, z, bytes, bs, raw);
+}
+
+/* The part of one cluster a read covers */
+typedef struct {
+	const extent *r;
+	size_t bytes;		/* bytes the cluster holds */
+	size_t off, n;		/* the bytes of it that are read */
+	_bool asIs;			/* it's stored uncompressed */
+	size_t first, cnt;	/* the blocks of its run that need reading */
+} piece;
+
+static piece piece_of(size_t j, size_t fPos, size_t size, size_t bs,
+					  size_t i, const fs_table *dt, const fs_table *fat) {
+	const size_t cb = ZCLUSTER_BLOCKS * bs, cStart = j * cb;
+	piece p			= {.r	  = &fat->runs[dt->files[i].blockMap[j]],
+					   .bytes = cluster_bytes(j, dt->dirs[i].size, cb),
+					   .off	  = MAX(fPos, cStart) - cStart};
+
+	p.n	   = MIN(fPos + size - cStart, cb) - p.off;
+	p.asIs = p.r->len == blocks_for(p.bytes, bs);
+
+	/* of a cluster stored as is, only the blocks covered are needed */
+	p.first = p.asIs ? p.off / bs : 0;
+	p.cnt	= p.asIs ? (p.off + p.n - 1) / bs - p.first + 1 : p.r->len;
+	return p;
+}
+
+/**
+ * @brief reads `size` bytes of a compressed file, starting `fPos` bytes in.
+ * The blocks of every cluster the read covers are all queued, then waited
+ * on once; clusters read whole are decompressed straight into `retBuf`.
+ *
+ * @pre the file's block map has been built
+ *
+ * @return 0 on success, negative on failure
+ */
+int read_clusters(size_t i, char *const retBuf, size_t size,
+				  const struct fs_settings *fss, size_t fPos,
+				  const fs_table *dt, const fs_table *fat) {
+	const size_t bs = fss->blockSize, cb = ZCLUSTER_BLOCKS * bs;
+	const size_t first = fPos / cb, last = (fPos + size - 1) / cb;
+
+	if (last >= dt->files[i].mapLen) {
+		fprintf(stderr, "read_clusters(): unexpected EoF reached\n");
+		return -4;
+	}
+
+	size_t blocks = 0;
+	for (size_t j = first; j <= last; j++)
+		blocks += piece_of(j, fPos, size, bs, i, dt, fat).cnt;
+
+	/* the blocks as they are on disk, then room for one cluster */
+	char *stage = malloc(blocks * bs + cb);
+	if (stage == NULL) {
+		perror("malloc() in read_clusters()");
+		return -5;
+	}
+
+	aio_batch batch;
+	aio_batch_init(&batch, bs);
+
+	/* a lone cluster is read right away; it may well be cached */
+	int ret	 = 0;
+	char *at = stage;
+	for (size_t j = first; j <= last; j++) {
+		piece p			 = piece_of(j, fPos, size, bs, i, dt, fat);
+		const size_t blk = p.r->start + p.first;
+
+		if (first == last) {
+			ret = read_blocks(blk, p.cnt, bs, at) != 0 ? -3 : 0;
+		} else if (aio_read(&batch, blk, p.cnt, at) != 0) {
+			break;
+		}
+		at += p.cnt * bs;
+	}
+
+	if (aio_wait(&batch) != 0)
+		ret = -3;
+	aio_batch_destroy(&batch);
+
+	char *out = retBuf, *raw = stage + blocks * bs;
+	at		  = stage;
+	for (size_t j = first; ret == 0 && j <= last; j++) {
+		piece p = piece_of(j, fPos, size, bs, i, dt, fat);
+
+		if (p.asIs) {
+			memcpy(out, at + p.off % bs, p.n);
+		} else if (p.n == p.bytes) {
+			ret = unpack(p.r, at, p.bytes, bs, out);
+		} else if ((ret = unpack(p.r, at, p.bytes, bs, raw)) == 0) {
+			memcpy(out, raw + p.off, p.n);
+		}
+
+		at += p.cnt * bs;
+		out += p.n;
+	}
+
+	free(stage);
+	return ret;
+}
+
+/**
+ * @brief stores the `j`'th cluster of a file, now `n` bytes long, from `raw`;
+ * compressing it if that saves a block, and moving it to a run of its own if
+ * it no longer fits the old one. Its blocks are queued as part of `batch`,
+ * straight from `raw`, which is left holding them.
+ *
+ * @param oldBytes the number of bytes the cluster held before
+ * @param z room for the cluster's blocks as they are on disk
+ *
+ * @return 0 on success, negative on failure
+ */
+static int store_cluster(size_t i, size_t j, char *raw, size_t oldBytes,
+						 size_t n, char *z, aio_batch *batch,
+						 struct fs_settings *fss, const fs_table *dt,
+						 const fs_table *fat) {
+	file_state *f	= &dt->files[i];
+	const size_t bs = fss->blockSize, lb = blocks_for(n, bs);
+
+	size_t m	 = lb;
+	zheader zLen = 0;
+	if (lb > 1)
+		zLen = lz_compress(raw, n, z + sizeof(zLen),
+						   (lb - 1) * bs - sizeof(zLen));
+
+	if (zLen > 0) {
+		memcpy(z, &zLen, sizeof(zLen));
+		m = blocks_for(sizeof(zLen) + zLen, bs);
+		memset(z + sizeof(zLen) + zLen, 0, m * bs - sizeof(zLen) - zLen);
+		memcpy(raw, z, m * bs);
+	} else {
+		memset(raw + n, 0, lb * bs - n);
+	}
+
+	const size_t e = j < f->mapLen ? f->blockMap[j] : NIL_IDX;
+	extent *r	   = e != NIL_IDX ? &fat->runs[e] : NULL;
+	size_t start   = SIZE_MAX;
+
+	if (r != NULL && r->len == m && blocks_for(oldBytes, bs) == lb) {
+		start = r->start;
+	} else {
+		size_t goal = r != NULL ? r->start
+					  : j > 0	? fat->runs[f->blockMap[j - 1]].start +
+								  fat->runs[f->blockMap[j - 1]].len
+								: SIZE_MAX;
+		start		= alloc_whole_run(goal, m, fss, fat);
+
+		/* with no room anywhere else, a cluster that hasn't grown is
+		 * overwritten in place after all */
+		if (start == SIZE_MAX && r != NULL && r->len >= m)
+			start = r->start;
+	}
+
+	if (start == SIZE_MAX) {
+		fprintf(stderr, ERR_NO_AVAILABLE_BLOCKS);
+		return -7;
+	}
+
+	const _bool moved = r == NULL || start != r->start;
+	if (aio_write(batch, start, m, raw) != 0) {
+		if (moved)
+			free_run(start, m, fss, fat);
+		return -5;
+	}
+
+	if (r == NULL) {
+		size_t prev = j > 0 ? f->blockMap[j - 1] : NIL_IDX;
+		size_t rec	= insert_run(&dt->dirs[i].firstBlockIdx, prev, start, m,
+								 fss, fat);
+		if (rec == NIL_IDX) {
+			free_run(start, m, fss, fat);
+			return -8;
+		}
+
+		f->blockMap[f->mapLen++] = rec;
+		md_mark_dir(i);
+		return 0;
+	}
+
+	if (moved)
+		free_run(r->start, r->len, fss, fat);
+	else if (r->len > m)
+		free_run(r->start + m, r->len - m, fss, fat);
+
+	if (moved || r->len != m) {
+		r->start = start;
+		r->len	 = m;
+		md_mark_fat(e);
+	}
+
+	return 0;
+}
+
+/**
+ * @brief writes a buf of data to a compressed file at `fPos`, a cluster at a
+ * time: each one the write covers is read in, unless it's covered entirely,
+ * updated, and stored again. The file's size follows each one as it's
+ * stored, so a write that fails midway leaves the clusters before it in
+ * place. Up to AIO_BATCH clusters are in flight at once, each from a slot of
+ * its own.
+ *
+ * @return 0 on success, negative on failure
+ */
+int write_clusters(size_t i, const char *buf, size_t size,
+				   struct fs_settings *fss, size_t fPos, const fs_table *dt,
+				   const fs_table *fat) {
+	const size_t bs = fss->blockSize, cb = ZCLUSTER_BLOCKS * bs;
+	const size_t end = fPos + size, first = fPos / cb;
+	const size_t slots = MIN(AIO_BATCH, blocks_for(end, cb) - first);
+	dir_entry *e	   = &dt->dirs[i];
+
+	if (blocks_for(end, bs) > fss->fMaxBlocks) {
+		fprintf(stderr, ERR_FILE_MAX_BLOCKS, fss->fMaxBlocks);
+		return -6;
+	}
+
+	if (get_block_map(i, fss, dt, fat) == NULL && e->firstBlockIdx != NIL_IDX)
+		return -8;
+
+	if (!reserve_block_map(i, blocks_for(end, cb), dt))
+		return -8;
+
+	/* the slots, then room for one cluster as it is on disk */
+	char *stage = malloc((slots + 1) * cb);
+	if (stage == NULL) {
+		perror("malloc() in write_clusters()");
+		return -8;
+	}
+
+	aio_batch batch;
+	aio_batch_init(&batch, bs);
+
+	int ret = 0;
+	for (size_t j = first; ret == 0 && j * cb < end; j++) {
+		const size_t cStart = j * cb, hi = MIN(end - cStart, cb);
+		const size_t lo		  = MAX(fPos, cStart) - cStart;
+		const size_t oldBytes = cluster_bytes(j, e->size, cb);
+		const size_t n		  = MAX(oldBytes, hi);
+		char *raw = stage + (j - first) % slots * cb, *z = stage + slots * cb;
+
+		/* a slot is only reused once the cluster in it is out */
+		if (j > first && (j - first) % slots == 0 && aio_wait(&batch) != 0) {
+			ret = -5;
+			break;
+		}
+
+		/* bytes of the cluster the write leaves alone are kept */
+		if ((lo > 0 || hi < oldBytes) &&
+			(ret = load_cluster(&fat->runs[dt->files[i].blockMap[j]], oldBytes,
+								bs, raw, z)) != 0)
+			break;
+
+		memcpy(raw + lo, buf + (cStart + lo - fPos), hi - lo);
+		if ((ret = store_cluster(i, j, raw, oldBytes, n, z, &batch, fss, dt,
+								 fat)) != 0)
+			break;
+
+		if (cStart + n > e->size) {
+			e->size = cStart + n;
+			md_mark_dir(i);
+		}
+	}
+
+	/* the data must be down before the journal commits the metadata */
+	if (aio_wait(&batch) != 0 && ret == 0)
+		ret = -5;
+	aio_batch_destroy(&batch);
+
+	free(stage);
+	return ret;
+}